@@ -0,0 +1,195 @@
+/*
+ * Copyright 2026 by the luit contributors
+ *
+ *                         All Rights Reserved
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted,
+ * provided that the above copyright notice appear in all copies and that
+ * both that copyright notice and this permission notice appear in
+ * supporting documentation, and that the name of the above listed
+ * copyright holder(s) not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.
+ *
+ * THE ABOVE LISTED COPYRIGHT HOLDER(S) DISCLAIM ALL WARRANTIES WITH REGARD
+ * TO THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL THE ABOVE LISTED COPYRIGHT HOLDER(S) BE
+ * LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Convert a file to UTF-8 with iconv(), in-process, for comparison with luit
+ * in the "run-bench" script.  The file is read into memory first, so that the
+ * timing covers only the conversion.  Prints the input and output sizes and
+ * the best time, in seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <iconv.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define BUFSIZE	65536
+
+static void
+usage(void)
+{
+    static const char *msg[] =
+    {
+	"Usage: iconv-loop [options] encoding file",
+	"",
+	"Options:",
+	"  -o file   write the converted text to this file",
+	"  -r count  repeat the conversion, reporting the best time",
+    };
+    size_t n;
+
+    for (n = 0; n < sizeof(msg) / sizeof(msg[0]); ++n)
+	fprintf(stderr, "%s\n", msg[n]);
+    exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + ((double) tv.tv_usec / 1e6);
+}
+
+static char *
+read_file(const char *name, size_t *length)
+{
+    FILE *fp;
+    char *result = 0;
+    size_t have = 0;
+    size_t used = 0;
+    size_t got;
+
+    if ((fp = fopen(name, "rb")) == 0) {
+	perror(name);
+	exit(EXIT_FAILURE);
+    }
+    do {
+	if (used + BUFSIZE > have) {
+	    have = (have + BUFSIZE) * 2;
+	    if ((result = realloc(result, have)) == 0) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	    }
+	}
+	got = fread(result + used, 1, BUFSIZE, fp);
+	used += got;
+    } while (got != 0);
+    fclose(fp);
+    *length = used;
+    return result;
+}
+
+/*
+ * Convert the whole buffer, writing the result to fp if it is not null.
+ * Returns the number of bytes written, or -1 on error.
+ */
+static long
+convert(iconv_t cd, char *input, size_t length, FILE *fp)
+{
+    static char output[BUFSIZE];
+    char *inbuf = input;
+    size_t inleft = length;
+    long result = 0;
+    int done = 0;
+
+    iconv(cd, NULL, NULL, NULL, NULL);
+    while (!done) {
+	char *outbuf = output;
+	size_t outleft = sizeof(output);
+	size_t rc;
+
+	if (inleft != 0) {
+	    rc = iconv(cd, &inbuf, &inleft, &outbuf, &outleft);
+	} else {
+	    rc = iconv(cd, NULL, NULL, &outbuf, &outleft);
+	    done = 1;
+	}
+	if (rc == (size_t) -1 && errno != E2BIG) {
+	    fprintf(stderr, "iconv: %s at offset %lu\n",
+		    strerror(errno),
+		    (unsigned long) (inbuf - input));
+	    return -1;
+	}
+	result += (long) (outbuf - output);
+	if (fp != 0)
+	    fwrite(output, 1, (size_t) (outbuf - output), fp);
+    }
+    return result;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *outname = 0;
+    int repeat = 1;
+    int ch;
+    int n;
+    char *input;
+    size_t length;
+    iconv_t cd;
+    long written = 0;
+    double best = -1.0;
+
+    while ((ch = getopt(argc, argv, "o:r:")) != -1) {
+	switch (ch) {
+	case 'o':
+	    outname = optarg;
+	    break;
+	case 'r':
+	    if ((repeat = atoi(optarg)) < 1)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 2)
+	usage();
+
+    if ((cd = iconv_open("UTF-8", argv[optind])) == (iconv_t) (-1)) {
+	perror(argv[optind]);
+	return EXIT_FAILURE;
+    }
+    input = read_file(argv[optind + 1], &length);
+
+    for (n = 0; n < repeat; ++n) {
+	double start = now();
+	double elapsed;
+
+	if ((written = convert(cd, input, length, NULL)) < 0)
+	    return EXIT_FAILURE;
+	elapsed = now() - start;
+	if (best < 0 || elapsed < best)
+	    best = elapsed;
+    }
+
+    if (outname != 0) {
+	FILE *fp;
+	if ((fp = fopen(outname, "wb")) == 0) {
+	    perror(outname);
+	    return EXIT_FAILURE;
+	}
+	convert(cd, input, length, fp);
+	fclose(fp);
+    }
+
+    printf("%lu %ld %.6f\n", (unsigned long) length, written, best);
+
+    iconv_close(cd);
+    free(input);
+    return EXIT_SUCCESS;
+}
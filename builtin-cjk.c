@@ -0,0 +1,13 @@
+/*
+ * $XTermId$
+ * This file was generated by ./make-tables
+ */
+#include <other.h>
+#include <sys.h>
+#include <luitconv.h>
+
+#define DATA(name) name, SizeOf(name), name##_pages, SizeOf(name##_pages)
+const BuiltInCharsetRec builtin_cjk_encodings[] =
+{
+    { 0, 0, 0, 0, 0 }
+};
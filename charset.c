@@ -204,10 +204,7 @@ FontencCharsetRecode(unsigned int n, const CharsetRec * self)
 
     result = MapCodeValue(n + fc->shift, fc->mapping);
 
-    TRACE(("FontencCharsetRecode %#x ->%#x%s\n",
-	   n,
-	   result,
-	   (n != result) ? " map" : ""));
+    TRACE_EVENT((evRECODE, n, result, (unsigned) self->type));
 
     return result;
 }
@@ -250,10 +247,7 @@ FontencCharsetReverse(unsigned int i, const CharsetRec * self)
 #undef IS_GL
     }
 
-    TRACE(("FontencCharsetReverse %#x ->%#x%s\n",
-	   i,
-	   result,
-	   ((int) i != result) ? " map" : ""));
+    TRACE_EVENT((evREVERSE, i, (unsigned) result, (unsigned) self->type));
 
     return result;
 }
@@ -324,6 +318,8 @@ addFontencCharset(const char *name, FontEncPtr f)
     }
 
     while (fc->name) {
+	if (!lcStrCmp(fc->name, name))
+	    return 1;
 	fc++;
     }
     if (fc < (limit - 1)) {
@@ -408,6 +404,7 @@ isOtherCharset(const char *name)
     int result = (fc->name != 0);
     if (!result) {
 	result = (!lcStrCmp(name, "Big5") ||
+		  !lcStrCmp(name, "CP932") ||
 		  !lcStrCmp(name, "JOHAB"));
     }
     return result;
@@ -727,7 +724,8 @@ findLocaleCharset(const char *charset)
 						   | (int) umBUILTIN));
 	if ((result = closestLocaleCharset(enc)) != 0) {
 	    TRACE(("...matched a LocaleCharset record for %s\n", NonNull(charset)));
-	} else if (canFakeLocaleCharset(enc)) {
+	} else if (canFakeLocaleCharset(enc)
+		   && addFontencCharset(charset, enc)) {
 	    LocaleCharsetRec *temp = &fakeLocaleCharset;
 
 	    TRACE(("...fake a LocaleCharset record for %s\n", NonNull(charset)));
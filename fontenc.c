@@ -29,6 +29,13 @@ THE SOFTWARE.
 #include <zlib.h>
 #endif
 
+#ifndef USE_FONTENC
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 #define flatUCode(row,col) (((row) << 8) + (col))
 
 typedef enum {
@@ -99,12 +106,17 @@ FontEncDirectory(void)
  */
 typedef struct {
     int used;
+    int order;			/* line order, to keep the first duplicate */
     char *alias;
+    char *key;			/* the alias, in lowercase */
     char *path;
     FontEncPtr data;
+    void *compiled;		/* data mapped from a compiled file */
+    size_t compiled_size;
 } ENCODINGS_DIR;
 
 static ENCODINGS_DIR *encodings_dir;
+static size_t num_encodings;
 
 /*
  * Read a buffer, trimming trailing whitespace (unlike getline, which in turn
@@ -163,49 +175,73 @@ getFileBuffer(char **bufferp, size_t *lengthp, FILE *fp)
 #ifndef USE_FONTENC
 #ifdef USE_ZLIB
 /*
- * Read a buffer, trimming trailing whitespace (unlike getline, which in turn
- * is not portable enough in any case).
+ * Read the whole of an encoding file into memory, inflating it if it is
+ * compressed (gzread passes an uncompressed file through as-is).  The buffer
+ * is null-terminated, for parsing in place.
  */
 static char *
-getGzipBuffer(char **bufferp, size_t *lengthp, gzFile fp)
+readEncFile(const char *path, size_t *lengthp)
 {
+    gzFile fp;
+    char *result = 0;
     size_t used = 0;
-    char extra[BUFSIZ];
-    int finished = 1;
 
-    if (*bufferp != 0)
-	**bufferp = '\0';
+    if ((fp = gzopen(path, "rb")) != 0) {
+	struct stat sb;
+	size_t have = BUFSIZ;
+	int got;
 
-    while (gzgets(fp, extra, (int) sizeof(extra) - 1)) {
-	size_t have = strlen(extra);
-	int found = 0;
-	finished = 0;
-	while (have != 0) {
-	    --have;
-	    if (extra[have] == '\n') {
-		found = 1;
+	/* compressed ".enc" files inflate to about four times their size */
+	if (stat(path, &sb) == 0 && sb.st_size > 0)
+	    have += (size_t) sb.st_size * 4;
+#if defined(ZLIB_VERNUM) && (ZLIB_VERNUM >= 0x1240)
+	gzbuffer(fp, 65536);
+#endif
+	if ((result = malloc(have)) == 0)
+	    FatalError("cannot allocate buffer for %s\n", path);
+	for (;;) {
+	    if (have - used < BUFSIZ) {
+		have *= 2;
+		if ((result = realloc(result, have)) == 0)
+		    FatalError("cannot allocate buffer for %s\n", path);
 	    }
-	    if (isspace(UChar(extra[have]))) {
-		extra[have] = '\0';
-	    } else {
+	    got = gzread(fp, result + used, (unsigned) (have - used - 1));
+	    if (got <= 0)
 		break;
-	    }
-	}
-	if (have) {
-	    size_t need = have + used + 2;
-	    if (*lengthp < need) {
-		*bufferp = realloc(*bufferp, need);
-		*lengthp = need;
-	    }
-	    strcpy(*bufferp + used, extra);
-	    used += have;
-	}
-	if (found) {
-	    break;
+	    used += (size_t) got;
 	}
+	result[used] = '\0';
+	gzclose(fp);
     }
+    *lengthp = used;
+    return result;
+}
+
+/*
+ * Split the next line from the buffer, trimming trailing whitespace.
+ */
+static char *
+nextEncLine(char **bufferp)
+{
+    char *result = 0;
+
+    if (**bufferp != '\0') {
+	char *next;
+	char *last;
 
-    return !finished ? *bufferp : 0;
+	result = *bufferp;
+	if ((next = strchr(result, '\n')) != 0) {
+	    last = next;
+	    *bufferp = next + 1;
+	} else {
+	    last = result + strlen(result);
+	    *bufferp = last;
+	}
+	while (last != result && isspace(UChar(last[-1])))
+	    --last;
+	*last = '\0';
+    }
+    return result;
 }
 #endif /* USE_ZLIB */
 #endif /* !USE_FONTENC */
@@ -237,12 +273,41 @@ absolutePath(char *given, const char *refPath)
     return result;
 }
 
+/*
+ * Names are matched ignoring case, so the entries are sorted by a lowercase
+ * key.  Entries with the same key are sorted by alias, and then by their
+ * order in "encodings.dir", so that the first of any duplicates is kept.
+ */
 static int
 compare_aliases(const void *a, const void *b)
 {
     const ENCODINGS_DIR *p = a;
     const ENCODINGS_DIR *q = b;
-    return strcmp(p->alias, q->alias);
+    int rc = strcmp(p->key, q->key);
+    if (rc == 0 && (rc = strcmp(p->alias, q->alias)) == 0)
+	rc = p->order - q->order;
+    return rc;
+}
+
+static int
+compare_keys(const void *a, const void *b)
+{
+    const ENCODINGS_DIR *p = a;
+    const ENCODINGS_DIR *q = b;
+    return strcmp(p->key, q->key);
+}
+
+static char *
+lowercaseKey(const char *name)
+{
+    char *result = strmalloc(name);
+    char *s;
+
+    if (result != 0) {
+	for (s = result; *s != '\0'; ++s)
+	    *s = (char) tolower(UChar(*s));
+    }
+    return result;
 }
 
 static char *
@@ -270,8 +335,8 @@ loadEncodingsDir(void)
 	size_t length = 0;
 	size_t entries = 0;
 	char *value;
-	int used = 0;
-	int n, found;
+	size_t used = 0;
+	size_t n;
 	int row = 0;
 
 	if (path == 0) {
@@ -296,18 +361,11 @@ loadEncodingsDir(void)
 		    }
 		} else if ((value = skipToWhite(buffer)) != 0) {
 		    *value++ = '\0';
-		    /* get rid of duplicates - they do occur */
-		    for (n = found = 0; n < used; ++n) {
-			if (!strcmp(buffer, encodings_dir[n].alias)) {
-			    found = 1;
-			    break;
-			}
-		    }
-		    if (!found) {
-			encodings_dir[used].alias = strmalloc(buffer);
-			encodings_dir[used].path = absolutePath(value, path);
-			++used;
-		    }
+		    encodings_dir[used].order = (int) used;
+		    encodings_dir[used].alias = strmalloc(buffer);
+		    encodings_dir[used].key = lowercaseKey(buffer);
+		    encodings_dir[used].path = absolutePath(value, path);
+		    ++used;
 
 		    if (++entry >= entries)
 			break;
@@ -317,11 +375,30 @@ loadEncodingsDir(void)
 	    }
 	    fclose(fp);
 	    if (used > 1) {
+		size_t keep = 1;
+
 		qsort(encodings_dir,
-		      (size_t) used,
+		      used,
 		      sizeof(encodings_dir[0]),
 		      compare_aliases);
+
+		/* get rid of duplicates - they do occur */
+		for (n = 1; n < used; ++n) {
+		    if (!strcmp(encodings_dir[n].alias,
+				encodings_dir[keep - 1].alias)) {
+			free(encodings_dir[n].alias);
+			free(encodings_dir[n].key);
+			free(encodings_dir[n].path);
+		    } else {
+			encodings_dir[keep++] = encodings_dir[n];
+		    }
+		}
+		memset(encodings_dir + keep, 0,
+		       (used - keep) * sizeof(encodings_dir[0]));
+		used = keep;
 	    }
+	    num_encodings = used;
+	    TRACE(("loaded %lu entries from %s\n", (unsigned long) used, path));
 	}
 	free(buffer);
     }
@@ -441,6 +518,11 @@ compareKeyword(char *value, const char *expected)
     return result;
 }
 
+/*
+ * Classify a line by its first token.  Most lines in a large encoding are
+ * definitions, so this checks for a digit first, and otherwise compares only
+ * the keywords which begin with the same letter.
+ */
 static FONTENC_TYPES
 getLineType(char *line, char **nextp)
 {
@@ -448,32 +530,53 @@ getLineType(char *line, char **nextp)
     char save;
 
     line = skipBlanks(line);
-    *nextp = skipNonblanks(line);
-    save = **nextp;
-    **nextp = '\0';
-
-    if (*line == '\0' || *line == '#') {
-	result = ftComment;
-    } else if (isdigit(UChar(*line))) {
+    if (isdigit(UChar(*line))) {
+	*nextp = line;
 	result = ftDefine;
-    } else if (!StrCaseCmp(line, "ALIAS")) {
-	result = ftAlias;
-    } else if (!StrCaseCmp(line, "STARTENCODING")) {
-	result = ftStartEncoding;
-    } else if (!StrCaseCmp(line, "STARTMAPPING")) {
-	result = ftStartMapping;
-    } else if (!StrCaseCmp(line, "ENDENCODING")) {
-	result = ftEndEncoding;
-    } else if (!StrCaseCmp(line, "ENDMAPPING")) {
-	result = ftEndMapping;
-    } else if (!StrCaseCmp(line, "SIZE")) {
-	result = ftSize;
-    } else if (!StrCaseCmp(line, "FIRSTINDEX")) {
-	result = ftFirstIndex;
-    } else if (!StrCaseCmp(line, "UNDEFINE")) {
-	result = ftUndefine;
+    } else {
+	*nextp = skipNonblanks(line);
+	save = **nextp;
+	**nextp = '\0';
+
+	switch (*line) {
+	case '\0':
+	case '#':
+	    result = ftComment;
+	    break;
+	case 'A':
+	case 'a':
+	    if (!StrCaseCmp(line, "ALIAS"))
+		result = ftAlias;
+	    break;
+	case 'E':
+	case 'e':
+	    if (!StrCaseCmp(line, "ENDMAPPING"))
+		result = ftEndMapping;
+	    else if (!StrCaseCmp(line, "ENDENCODING"))
+		result = ftEndEncoding;
+	    break;
+	case 'F':
+	case 'f':
+	    if (!StrCaseCmp(line, "FIRSTINDEX"))
+		result = ftFirstIndex;
+	    break;
+	case 'S':
+	case 's':
+	    if (!StrCaseCmp(line, "SIZE"))
+		result = ftSize;
+	    else if (!StrCaseCmp(line, "STARTMAPPING"))
+		result = ftStartMapping;
+	    else if (!StrCaseCmp(line, "STARTENCODING"))
+		result = ftStartEncoding;
+	    break;
+	case 'U':
+	case 'u':
+	    if (!StrCaseCmp(line, "UNDEFINE"))
+		result = ftUndefine;
+	    break;
+	}
+	**nextp = save;
     }
-    **nextp = save;
     return result;
 }
 
@@ -511,44 +614,34 @@ fontencFirst(FontEncPtr enc)
     return result;
 }
 
-static int
-fontencIndex(FontEncPtr enc, unsigned from)
+/*
+ * The unicode mapping which is being loaded, with the limits used to index it
+ * computed once rather than for each code.
+ */
+typedef struct {
+    UCode *map;
+    int row_size;
+    int first;
+    int limit;
+} MAP_TARGET;
+
+static void
+defineCode(MAP_TARGET * target, int from, int to)
 {
-    int result;
+    if (target->map != 0 && from >= MIN_UCODE && from <= MAX_UCODE) {
+	int inx = from;
 
-    if ((int) from < MIN_UCODE) {
-	result = -1;
-    } else if (from <= MAX_UCODE) {
-	if (enc->row_size == 0) {
-	    result = (int) from;
-	} else {
-	    int row = (int) rowOf(from);
+	if (target->row_size != 0) {
 	    int col = (int) colOf(from);
 
-	    if (col >= enc->row_size) {
-		result = -1;
+	    if (col >= target->row_size) {
+		inx = -1;
 	    } else {
-		result = (row * enc->row_size) + col;
+		inx = ((int) rowOf(from) * target->row_size) + col;
 	    }
 	}
-    } else {
-	result = -1;
-    }
-    return result;
-}
-
-static void
-defineCode(FontEncPtr enc, int from, int to)
-{
-    int inx = fontencIndex(enc, (unsigned) from);
-
-    if (inx >= 0 && enc->mappings != NULL) {
-	int first = fontencFirst(enc);
-	FontEncSimpleMapPtr data = enc->mappings->client_data;
-	int limit = (int) fontencSize(enc);
-
-	if (inx >= first && (unsigned) inx < data->len && inx < limit) {
-	    data->map[inx - first] = (UCode) to;
+	if (inx >= target->first && inx < target->limit) {
+	    target->map[inx - target->first] = (UCode) to;
 	}
     }
 }
@@ -637,6 +730,23 @@ luitRecode(unsigned code, void *client_data)
 		hi_char = value; \
 	    }
 
+static FontEncSimpleMapPtr
+findUnicodeMapping(FontEncPtr data)
+{
+    FontEncSimpleMapPtr mq = 0;
+    FontMapPtr mp;
+
+    for (mp = data->mappings; mp != NULL; mp = mp->next) {
+	if (mp->type == FONT_ENCODING_UNICODE) {
+	    mq = mp->client_data;
+	    if (mq->map == NULL)
+		mq = NULL;
+	    break;
+	}
+    }
+    return mq;
+}
+
 /*
  * Read an encoding file, report summary statistics.
  */
@@ -647,13 +757,13 @@ loadFontEncRec(const char *charset, const char *path)
 #if defined(USE_FONTENC)
     result = FontEncReallyLoad(charset, path);
 #elif defined(USE_ZLIB)
-    gzFile fp;
-    char *buffer = 0;
+    char *buffer;
     size_t length = 0;
     size_t numAliases = 0;
     size_t result_size = 0;
     int numbers[MAX_NUMBERS];
     FontMapPtr mapping = 0;
+    MAP_TARGET target;
     int done = 0;
 
     (void) charset;
@@ -661,14 +771,16 @@ loadFontEncRec(const char *charset, const char *path)
     if ((result = calloc((size_t) 1, sizeof(*result))) == 0)
 	return 0;
 
-    fp = gzopen(path, "r");
-    if (fp != 0) {
-	int count = 0;
+    memset(&target, 0, sizeof(target));
+    if ((buffer = readEncFile(path, &length)) != 0) {
+	char *cursor = buffer;
+	char *line;
 	int ignore = 0;
-	while (!done && getGzipBuffer(&buffer, &length, fp)) {
+
+	TRACE(("loadFontEncRec %s: %lu bytes\n", path, (unsigned long) length));
+	while (!done && (line = nextEncLine(&cursor)) != 0) {
 	    char *later;
-	    ++count;
-	    switch (getLineType(buffer, &later)) {
+	    switch (getLineType(line, &later)) {
 	    case ftComment:
 		break;
 	    case ftStartEncoding:
@@ -734,11 +846,11 @@ loadFontEncRec(const char *charset, const char *path)
 			break;
 		    case 2:
 			for (code = numbers[0]; code <= numbers[1]; ++code) {
-			    defineCode(result, code, 0);
+			    defineCode(&target, code, 0);
 			}
 			break;
 		    case 1:
-			defineCode(result, numbers[0], 0);
+			defineCode(&target, numbers[0], 0);
 			break;
 		    }
 		}
@@ -748,17 +860,17 @@ loadFontEncRec(const char *charset, const char *path)
 		    int from;
 		    int to;
 
-		    switch (getNumbers(buffer, numbers)) {
+		    switch (getNumbers(later, numbers)) {
 		    case 1:
 			/* ignore */
 			break;
 		    case 2:
-			defineCode(result, numbers[0], numbers[1]);
+			defineCode(&target, numbers[0], numbers[1]);
 			break;
 		    case 3:
 			to = numbers[2];
 			for (from = numbers[0]; from <= numbers[1]; ++from) {
-			    defineCode(result, from, to++);
+			    defineCode(&target, from, to++);
 			}
 			break;
 		    }
@@ -799,6 +911,11 @@ loadFontEncRec(const char *charset, const char *path)
 
 		    mapping->client_data = mq;
 		    result->mappings = mapping;
+
+		    target.map = mq->map;
+		    target.row_size = result->row_size;
+		    target.first = mq->first;
+		    target.limit = (int) result_size;
 		} else {
 		    ignore = 1;
 		}
@@ -812,11 +929,10 @@ loadFontEncRec(const char *charset, const char *path)
 		break;
 	    default:
 		if (!ignore)
-		    printf("\t->%s\n", buffer);
+		    printf("\t->%s\n", line);
 		break;
 	    }
 	}
-	gzclose(fp);
 	free(buffer);
     }
 
@@ -830,13 +946,241 @@ loadFontEncRec(const char *charset, const char *path)
     return result;
 }
 
+#if !defined(USE_FONTENC) && defined(USE_ZLIB)
+/*
+ * Parsing a large encoding file takes longer than mapping its data from a
+ * file written in the form luit uses.  After loading a two-byte encoding,
+ * save that form in share_dir; later runs use it until the encoding file
+ * changes.
+ */
+#define COMPILED_MAGIC	"luit-enc"
+#define COMPILED_VERSION 1
+#define COMPILED_MIN	0x100	/* one-byte encodings are quicker to parse */
+
+typedef struct {
+    char magic[8];		/* COMPILED_MAGIC, without null */
+    unsigned version;		/* COMPILED_VERSION */
+    unsigned map_len;		/* length of map[], or 0 if no unicode mapping */
+    long source_size;		/* size and time of the encoding file */
+    long source_time;
+    int size;			/* the FontEncRec fields */
+    int row_size;
+    int first;
+    int first_col;
+    unsigned map_first;		/* the FontEncSimpleMapRec fields */
+    unsigned map_row_size;
+    unsigned num_aliases;
+    unsigned text_size;		/* path, name and aliases, each null-ended */
+} COMPILED_ENC;
+/* the header is followed by map[], then the text */
+
+static char *
+compiledKey(const char *alias)
+{
+    char *result = malloc(strlen(alias) + 5);
+
+    if (result != 0)
+	sprintf(result, "enc-%s", alias);
+    return result;
+}
+
+/*
+ * Check that the text holds the expected number of strings, returning a
+ * pointer past the first (the path).
+ */
+static const char *
+validCompiledText(const char *text, size_t length, unsigned count)
+{
+    const char *result = 0;
+    const char *last = text + length;
+    const char *s = text;
+    unsigned n = 0;
+
+    if (length != 0 && last[-1] == '\0') {
+	while (s < last) {
+	    s += strlen(s) + 1;
+	    if (n++ == 0)
+		result = s;
+	}
+	if (n != count)
+	    result = 0;
+    }
+    return result;
+}
+
+static FontEncPtr
+loadCompiledEnc(ENCODINGS_DIR * entry, struct stat *source)
+{
+    FontEncPtr result = 0;
+    struct stat sb;
+    char *key;
+    int fd = -1;
+
+    if ((key = compiledKey(entry->alias)) != 0) {
+	fd = openSharedFile(key, (unsigned long) getuid(), &sb);
+	free(key);
+    }
+    if (fd >= 0) {
+	void *addr = MAP_FAILED;
+	size_t size = (size_t) sb.st_size;
+
+	if (size > sizeof(COMPILED_ENC)) {
+	    /* private, since fill_fontenc may alter the map */
+	    addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if (addr != MAP_FAILED) {
+	    const COMPILED_ENC *header = addr;
+	    UCode *map = (UCode *) ((char *) addr + sizeof(*header));
+	    const char *text = (char *) (map + header->map_len);
+	    const char *name;
+
+	    if (!memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic))
+		&& header->version == COMPILED_VERSION
+		&& header->source_size == (long) source->st_size
+		&& header->source_time == (long) source->st_mtime
+		&& header->map_len <= (MAX_UCODE + 1)
+		&& header->num_aliases < 256
+		&& size == (sizeof(*header)
+			    + (header->map_len * sizeof(UCode))
+			    + header->text_size)
+		&& (name = validCompiledText(text,
+					     header->text_size,
+					     header->num_aliases + 2)) != 0
+		&& !strcmp(text, entry->path)
+		&& (result = TypeCalloc(FontEncRec)) != 0) {
+		unsigned n;
+
+		result->name = strmalloc(name);
+		result->size = header->size;
+		result->row_size = header->row_size;
+		result->first = header->first;
+		result->first_col = header->first_col;
+		if (header->num_aliases != 0) {
+		    if ((result->aliases = TypeCallocN(char *,
+						       header->num_aliases + 1))
+			== 0)
+			FatalError("cannot allocate aliases\n");
+		    for (n = 0; n < header->num_aliases; ++n) {
+			name += strlen(name) + 1;
+			result->aliases[n] = strmalloc(name);
+		    }
+		}
+		if (header->map_len != 0) {
+		    FontMapPtr mapping;
+		    FontEncSimpleMapPtr mq;
+
+		    if ((mapping = TypeCalloc(FontMapRec)) == 0
+			|| (mq = TypeCalloc(FontEncSimpleMapRec)) == 0)
+			FatalError("cannot allocate map record\n");
+		    mapping->type = FONT_ENCODING_UNICODE;
+		    mapping->recode = luitRecode;
+		    mapping->client_data = mq;
+		    mq->map = map;
+		    mq->len = header->map_len;
+		    mq->first = (UCode) header->map_first;
+		    mq->row_size = (UCode) header->map_row_size;
+		    result->mappings = mapping;
+		}
+		entry->compiled = addr;
+		entry->compiled_size = size;
+		TRACE(("loaded compiled %s\n", entry->alias));
+	    } else {
+		munmap(addr, size);
+	    }
+	}
+    }
+    return result;
+}
+
+static void
+saveCompiledEnc(ENCODINGS_DIR * entry, struct stat *source, FontEncPtr data)
+{
+    FontEncSimpleMapPtr mq = findUnicodeMapping(data);
+    COMPILED_ENC header;
+    char *key;
+    char *text;
+    size_t need;
+    unsigned n = 0;
+
+    if (mq == 0 || mq->len <= COMPILED_MIN)
+	return;
+
+    need = strlen(entry->path) + strlen(data->name) + 2;
+    if (data->aliases != 0) {
+	for (n = 0; data->aliases[n] != 0; ++n)
+	    need += strlen(data->aliases[n]) + 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+    header.version = COMPILED_VERSION;
+    header.map_len = mq->len;
+    header.source_size = (long) source->st_size;
+    header.source_time = (long) source->st_mtime;
+    header.size = data->size;
+    header.row_size = data->row_size;
+    header.first = data->first;
+    header.first_col = data->first_col;
+    header.map_first = mq->first;
+    header.map_row_size = mq->row_size;
+    header.num_aliases = n;
+    header.text_size = (unsigned) need;
+
+    if ((text = malloc(need)) != 0
+	&& (key = compiledKey(entry->alias)) != 0) {
+	const void *parts[3];
+	size_t lengths[3];
+	char *s = text;
+
+	s += strlen(strcpy(s, entry->path)) + 1;
+	s += strlen(strcpy(s, data->name)) + 1;
+	for (n = 0; n < header.num_aliases; ++n)
+	    s += strlen(strcpy(s, data->aliases[n])) + 1;
+
+	parts[0] = &header;
+	lengths[0] = sizeof(header);
+	parts[1] = mq->map;
+	lengths[1] = mq->len * sizeof(UCode);
+	parts[2] = text;
+	lengths[2] = need;
+	writeSharedFile(key, parts, lengths, 3);
+	free(key);
+    }
+    free(text);
+}
+#endif /* !USE_FONTENC && USE_ZLIB */
+
+/*
+ * Load the encoding for an entry in "encodings.dir", using the compiled form
+ * if it is up to date.
+ */
+static FontEncPtr
+loadFontEnc(ENCODINGS_DIR * entry)
+{
+    FontEncPtr result;
+#if !defined(USE_FONTENC) && defined(USE_ZLIB)
+    struct stat sb;
+
+    if (stat(entry->path, &sb) != 0) {
+	result = loadFontEncRec(entry->alias, entry->path);
+    } else if ((result = loadCompiledEnc(entry, &sb)) == 0
+	       && (result = loadFontEncRec(entry->alias, entry->path)) != 0) {
+	saveCompiledEnc(entry, &sb, result);
+    }
+#else
+    result = loadFontEncRec(entry->alias, entry->path);
+#endif
+    return result;
+}
+
 /*
  * Find an encoding, given its name.
  */
 FontEncPtr
 lookupOneFontenc(const char *name)
 {
-    int n;
     FontEncPtr result = 0;
 
 #ifdef USE_FONTENC
@@ -844,28 +1188,37 @@ lookupOneFontenc(const char *name)
     if (result == 0)
 #endif
     {
+	ENCODINGS_DIR find;
+	ENCODINGS_DIR *entry;
+
 	loadEncodingsDir();
-	if (encodings_dir != 0) {
-	    for (n = 0; encodings_dir[n].alias != 0; ++n) {
-		if (!StrCaseCmp(name, encodings_dir[n].alias)) {
-		    if ((result = encodings_dir[n].data) == 0
-			&& encodings_dir[n].used == 0) {
-			result = loadFontEncRec(encodings_dir[n].alias,
-						encodings_dir[n].path);
-			if (result == 0) {
-			    Warning("cannot load data for %s\n",
-				    encodings_dir[n].path);
-			} else {
-			    VERBOSE(1, ("load alias \"%s\" from \"%s\"\n",
-					encodings_dir[n].alias,
-					encodings_dir[n].path));
-			}
-			encodings_dir[n].used = 1;
-			encodings_dir[n].data = result;
+	if (encodings_dir != 0
+	    && (find.key = lowercaseKey(name)) != 0) {
+	    entry = bsearch(&find,
+			    encodings_dir,
+			    num_encodings,
+			    sizeof(encodings_dir[0]),
+			    compare_keys);
+	    if (entry != 0) {
+		/* use the first of the aliases which differ only in case */
+		while (entry != encodings_dir
+		       && !strcmp(entry[-1].key, find.key))
+		    --entry;
+		if ((result = entry->data) == 0
+		    && entry->used == 0) {
+		    result = loadFontEnc(entry);
+		    if (result == 0) {
+			Warning("cannot load data for %s\n", entry->path);
+		    } else {
+			VERBOSE(1, ("load alias \"%s\" from \"%s\"\n",
+				    entry->alias,
+				    entry->path));
 		    }
-		    break;
+		    entry->used = 1;
+		    entry->data = result;
 		}
 	    }
+	    free(find.key);
 	}
     }
     return result;
@@ -893,23 +1246,6 @@ fontmapTypename(int type)
     return result;
 }
 
-static FontEncSimpleMapPtr
-findUnicodeMapping(FontEncPtr data)
-{
-    FontEncSimpleMapPtr mq = 0;
-    FontMapPtr mp;
-
-    for (mp = data->mappings; mp != NULL; mp = mp->next) {
-	if (mp->type == FONT_ENCODING_UNICODE) {
-	    mq = mp->client_data;
-	    if (mq->map == NULL)
-		mq = NULL;
-	    break;
-	}
-    }
-    return mq;
-}
-
 /*
  * Read an encoding file, report summary statistics.
  */
@@ -1222,8 +1558,25 @@ fontenc_leaks(void)
     if (encodings_dir != 0) {
 	int enc;
 	for (enc = 0; encodings_dir[enc].alias != 0; ++enc) {
+#if !defined(USE_FONTENC) && defined(USE_ZLIB)
+	    if (encodings_dir[enc].compiled != 0) {
+		char *first = encodings_dir[enc].compiled;
+		char *last = first + encodings_dir[enc].compiled_size;
+		FontEncSimpleMapPtr mq;
+
+		/* the map is part of the compiled data */
+		if (encodings_dir[enc].data != 0
+		    && (mq = findUnicodeMapping(encodings_dir[enc].data)) != 0
+		    && (char *) mq->map >= first
+		    && (char *) mq->map < last)
+		    mq->map = 0;
+		munmap(encodings_dir[enc].compiled,
+		       encodings_dir[enc].compiled_size);
+	    }
+#endif
 	    freeFontEncRec(encodings_dir[enc].data);
 	    free(encodings_dir[enc].alias);
+	    free(encodings_dir[enc].key);
 	    free(encodings_dir[enc].path);
 	}
 	free(encodings_dir);
@@ -27,17 +27,31 @@ THE SOFTWARE.
 
 #include <unistd.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include <sys.h>
+#include <logging.h>
 
 #define BUFFERED_INPUT_SIZE 4
 static unsigned char buffered_input[BUFFERED_INPUT_SIZE];
 static int buffered_input_count = 0;
 
-static void terminateEsc(Iso2022Ptr, int, unsigned char *, unsigned);
-static void terminate(Iso2022Ptr, int);
+static void terminateEsc(Iso2022Ptr, int, const unsigned char *, unsigned);
+static void terminate(Iso2022Ptr, int, const unsigned char *, unsigned);
+static void freeInputMap(Iso2022Ptr);
+static void countDecoded(Iso2022Ptr, const CharsetRec *);
+static void countSequence(Iso2022Ptr, const unsigned char *, unsigned);
 
-#define OUTBUF_FREE(is, count) ((is)->outbuf_count + (count) <= BUFFER_SIZE)
+#define COUNT_DECODED(is, cs) do { \
+	if ((is)->stats.last_charset != (cs)) \
+	    countDecoded((is), (cs)); \
+	(is)->stats.last_count++; \
+    } while (0)
+
+/* characters decoded before encoding them together */
+#define RUN_SIZE 256
+
+#define OUTBUF_FREE(is, count) ((is)->outbuf_count + (count) <= OUTBUF_SIZE)
 #define OUTBUF_MAKE_FREE(is, fd, count) \
     if(!OUTBUF_FREE((is), (count))) outbuf_flush((is), (fd))
 
@@ -86,86 +100,356 @@ trace_iso2022(const char *tag, const Iso2022Ptr ptr)
 #define trace_iso2022(tag, ptr)	/* nothing */
 #endif
 
-static void
-outbuf_flush(Iso2022Ptr is, int fd)
+static double
+statsNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + ((double) tv.tv_usec / 1e6);
+}
+
+/*
+ * Wait for the output to drain, accumulating the time spent blocked.
+ */
+static int
+statsWaitForOutput(Iso2022Ptr is, int fd)
 {
+    struct timeval t0, t1;
     int rc;
-    unsigned i = 0;
 
-    if (olog >= 0)
-	IGNORE_RC(write(olog, is->outbuf, is->outbuf_count));
+    gettimeofday(&t0, NULL);
+    rc = waitForOutput(fd);
+    gettimeofday(&t1, NULL);
+
+    is->stats.waits++;
+    is->stats.blocked += ((double) (t1.tv_sec - t0.tv_sec)
+			  + (double) (t1.tv_usec - t0.tv_usec) / 1e6);
+    TRACE_EVENT((evWAIT, (unsigned) fd, (unsigned) rc,
+		 (unsigned) ((t1.tv_sec - t0.tv_sec) * 1000000
+			     + (t1.tv_usec - t0.tv_usec))));
+    return rc;
+}
+
+/*
+ * Write as much as the file descriptor will accept without blocking.  Returns
+ * the number of bytes written, or -1 if it cannot be written at all, noting
+ * the first error in write_error.
+ */
+static int
+write_some(Iso2022Ptr is, int fd, const unsigned char *data, size_t length)
+{
+    size_t done = 0;
 
-    while (i < is->outbuf_count) {
-	rc = (int) write(fd, is->outbuf + i, is->outbuf_count - i);
+    while (done < length) {
+	ssize_t rc = write(fd, data + done, length - done);
 	if (rc > 0) {
-	    i += (unsigned) rc;
+	    done += (size_t) rc;
+	    if (done < length)
+		is->stats.short_writes++;
+	} else if (rc < 0 && errno == EINTR) {
+	    continue;
+	} else if (rc == 0 || errno == EAGAIN) {
+	    break;
 	} else {
-	    if (rc < 0 && errno == EINTR)
-		continue;
-	    else if ((rc == 0) || ((rc < 0) && (errno == EAGAIN))) {
-		if (waitForOutput(fd) == IO_Closed)
-		    break;
-		continue;
-	    } else
+	    if (is->write_error == 0)
+		is->write_error = errno;
+	    return -1;
+	}
+    }
+    is->stats.bytes_out += done;
+    return (int) done;
+}
+
+/*
+ * Make room in the queue for the given number of bytes, moving its contents
+ * to the beginning if needed.
+ */
+static int
+queue_room(Iso2022Ptr is, size_t need)
+{
+    if (is->queue_head + is->queue_count + need > QUEUE_SIZE
+	&& is->queue_head != 0) {
+	memmove(is->queue, is->queue + is->queue_head, is->queue_count);
+	is->queue_head = 0;
+    }
+    return (is->queue_count + need <= QUEUE_SIZE);
+}
+
+/*
+ * Write the output buffer, queuing whatever the file descriptor will not
+ * accept.  The event loop stops reading before the queue fills, so waiting
+ * for it to drain here is only a fallback.
+ */
+static void
+outbuf_write(Iso2022Ptr is, int fd)
+{
+    size_t done = 0;
+
+    is->stats.flushes++;
+    if (is->queue_count == 0) {
+	int rc = write_some(is, fd, is->outbuf, is->outbuf_count);
+	done = (rc < 0) ? is->outbuf_count : (size_t) rc;
+    }
+    if (done < is->outbuf_count) {
+	size_t need = is->outbuf_count - done;
+
+	while (!queue_room(is, need)) {
+	    if (statsWaitForOutput(is, fd) == IO_Closed
+		|| drainIso2022(is, fd) < 0) {
+		need = 0;
 		break;
+	    }
 	}
+	memcpy(is->queue + is->queue_head + is->queue_count,
+	       is->outbuf + done,
+	       need);
+	is->queue_count += need;
     }
+    TRACE_EVENT((evFLUSH, (unsigned) fd,
+		 (unsigned) is->outbuf_count,
+		 (unsigned) is->queue_count));
     is->outbuf_count = 0;
+    is->flush_due.tv_sec = 0;
+    is->flush_due.tv_usec = 0;
 }
 
 static void
-outbufOne(Iso2022Ptr is, int fd, unsigned c)
+outbuf_flush(Iso2022Ptr is, int fd)
 {
-    OUTBUF_MAKE_FREE(is, fd, 1);
-    is->outbuf[is->outbuf_count++] = UChar(c);
+    writeLog(olog, is->outbuf, is->outbuf_count);
+    outbuf_write(is, fd);
 }
 
-/* Discards null codepoints */
+/*
+ * Encode c in UTF-16 or UTF-32, returning the next position.
+ */
+static unsigned char *
+encodeWide(unsigned char *p, unsigned c, int encoding)
+{
+    switch (encoding) {
+    case OE_UTF16LE:
+    case OE_UTF16BE:
+	if (c > 0xFFFF) {
+	    c -= 0x10000;
+	    p = encodeWide(p, 0xD800 | (c >> 10), encoding);
+	    c = 0xDC00 | (c & 0x3FF);
+	}
+	if (encoding == OE_UTF16LE) {
+	    *p++ = UChar(c & 0xFF);
+	    *p++ = UChar((c >> 8) & 0xFF);
+	} else {
+	    *p++ = UChar((c >> 8) & 0xFF);
+	    *p++ = UChar(c & 0xFF);
+	}
+	break;
+    case OE_UTF32LE:
+	*p++ = UChar(c & 0xFF);
+	*p++ = UChar((c >> 8) & 0xFF);
+	*p++ = UChar((c >> 16) & 0xFF);
+	*p++ = UChar((c >> 24) & 0xFF);
+	break;
+    case OE_UTF32BE:
+	*p++ = UChar((c >> 24) & 0xFF);
+	*p++ = UChar((c >> 16) & 0xFF);
+	*p++ = UChar((c >> 8) & 0xFF);
+	*p++ = UChar(c & 0xFF);
+	break;
+    }
+    return p;
+}
+
+/*
+ * Write bytes which are passed through, such as controls and escape sequences,
+ * widened to the UTF-16 or UTF-32 output encoding.
+ */
 static void
-outbufUTF8(Iso2022Ptr is, int fd, unsigned c)
+outbufWideBytes(Iso2022Ptr is, int fd, const unsigned char *data, size_t count)
 {
-    if (c == 0)
-	return;
+    while (count != 0) {
+	size_t room = (OUTBUF_SIZE - is->outbuf_count) / 4;
+	unsigned char *p;
+
+	if (room == 0) {
+	    outbuf_flush(is, fd);
+	    continue;
+	}
+	if (room > count)
+	    room = count;
+	count -= room;
+	p = is->outbuf + is->outbuf_count;
+	while (room-- != 0)
+	    p = encodeWide(p, *data++, is->outputEncoding);
+	is->outbuf_count = (size_t) (p - is->outbuf);
+    }
+}
 
-    if (c <= 0x7F) {
+static void
+outbufOne(Iso2022Ptr is, int fd, unsigned c)
+{
+    if (OE_WIDE(is)) {
+	unsigned char byte = UChar(c);
+	outbufWideBytes(is, fd, &byte, (size_t) 1);
+    } else {
 	OUTBUF_MAKE_FREE(is, fd, 1);
 	is->outbuf[is->outbuf_count++] = UChar(c);
-    } else if (c <= 0x7FF) {
-	OUTBUF_MAKE_FREE(is, fd, 2);
-	is->outbuf[is->outbuf_count++] = UChar(0xC0 | ((c >> 6) & 0x1F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | (c & 0x3F));
-    } else if (c <= 0xFFFF) {
-	OUTBUF_MAKE_FREE(is, fd, 3);
-	is->outbuf[is->outbuf_count++] = UChar(0xE0 | ((c >> 12) & 0x0F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 6) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | (c & 0x3F));
-    } else if (c <= 0x1FFFFF) {
-	OUTBUF_MAKE_FREE(is, fd, 4);
-	is->outbuf[is->outbuf_count++] = UChar(0xF0 | ((c >> 18) & 0x07));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 12) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 6) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | (c & 0x3F));
-    } else if (c <= 0x03FFFFFF) {
-	OUTBUF_MAKE_FREE(is, fd, 5);
-	is->outbuf[is->outbuf_count++] = UChar(0xF8 | ((c >> 24) & 0x03));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 18) & 0x3f));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 12) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 6) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | (c & 0x3F));
-    } else if (c <= 0x7FFFFFFF) {
-	OUTBUF_MAKE_FREE(is, fd, 6);
-	is->outbuf[is->outbuf_count++] = UChar(0xFC | ((c >> 30) & 0x01));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 24) & 0x3f));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 18) & 0x3f));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 12) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | ((c >> 6) & 0x3F));
-	is->outbuf[is->outbuf_count++] = UChar(0x80 | (c & 0x3F));
+    }
+}
+
+/*
+ * Return the length of the UTF-8 encoding of c, or zero if it is discarded.
+ */
+static unsigned
+lengthUTF8(unsigned c)
+{
+    unsigned result;
+
+    if (c == 0)
+	result = 0;
+    else if (c <= 0x7F)
+	result = 1;
+    else if (c <= 0x7FF)
+	result = 2;
+    else if (c <= 0xFFFF)
+	result = 3;
+    else if (c <= 0x1FFFFF)
+	result = 4;
+    else if (c <= 0x03FFFFFF)
+	result = 5;
+    else if (c <= 0x7FFFFFFF)
+	result = 6;
+    else
+	result = 0;
+    return result;
+}
+
+/*
+ * Encode c, given the length from lengthUTF8, returning the next position.
+ */
+static unsigned char *
+encodeUTF8(unsigned char *p, unsigned c, unsigned len)
+{
+    switch (len) {
+    case 1:
+	*p++ = UChar(c);
+	break;
+    case 2:
+	*p++ = UChar(0xC0 | ((c >> 6) & 0x1F));
+	*p++ = UChar(0x80 | (c & 0x3F));
+	break;
+    case 3:
+	*p++ = UChar(0xE0 | ((c >> 12) & 0x0F));
+	*p++ = UChar(0x80 | ((c >> 6) & 0x3F));
+	*p++ = UChar(0x80 | (c & 0x3F));
+	break;
+    case 4:
+	*p++ = UChar(0xF0 | ((c >> 18) & 0x07));
+	*p++ = UChar(0x80 | ((c >> 12) & 0x3F));
+	*p++ = UChar(0x80 | ((c >> 6) & 0x3F));
+	*p++ = UChar(0x80 | (c & 0x3F));
+	break;
+    case 5:
+	*p++ = UChar(0xF8 | ((c >> 24) & 0x03));
+	*p++ = UChar(0x80 | ((c >> 18) & 0x3f));
+	*p++ = UChar(0x80 | ((c >> 12) & 0x3F));
+	*p++ = UChar(0x80 | ((c >> 6) & 0x3F));
+	*p++ = UChar(0x80 | (c & 0x3F));
+	break;
+    case 6:
+	*p++ = UChar(0xFC | ((c >> 30) & 0x01));
+	*p++ = UChar(0x80 | ((c >> 24) & 0x3f));
+	*p++ = UChar(0x80 | ((c >> 18) & 0x3f));
+	*p++ = UChar(0x80 | ((c >> 12) & 0x3F));
+	*p++ = UChar(0x80 | ((c >> 6) & 0x3F));
+	*p++ = UChar(0x80 | (c & 0x3F));
+	break;
+    }
+    return p;
+}
+
+/* Count a codepoint which lengthUTF8 rejected */
+static void
+discardUTF8(Iso2022Ptr is, unsigned c)
+{
+    if (c == 0) {
+	is->stats.dropped++;
     } else {
 	/* "21 bits ought to be enough for anybody!" -- The Unicode Consortium */
 	Warning("ignoring character beyond UTF-8's 31-bit range: 0x%X.\n", c);
     }
 }
 
+/* Discards null codepoints */
+static void
+outbufUTF8(Iso2022Ptr is, int fd, unsigned c)
+{
+    unsigned len = lengthUTF8(c);
+
+    if (len != 0) {
+	unsigned char *p;
+
+	OUTBUF_MAKE_FREE(is, fd, len);
+	p = encodeUTF8(is->outbuf + is->outbuf_count, c, len);
+	is->outbuf_count = (size_t) (p - is->outbuf);
+    } else {
+	discardUTF8(is, c);
+    }
+}
+
+/*
+ * Encode a run of decoded characters, making room in the output buffer once
+ * for the whole run.  The run must be short enough to fit in the buffer.
+ */
+static void
+outbufUTF8Run(Iso2022Ptr is, int fd, const unsigned *codes, size_t count)
+{
+    unsigned char *p;
+    size_t need = 0;
+    size_t n;
+
+    for (n = 0; n < count; ++n)
+	need += lengthUTF8(codes[n]);
+    OUTBUF_MAKE_FREE(is, fd, need);
+
+    p = is->outbuf + is->outbuf_count;
+    for (n = 0; n < count; ++n) {
+	unsigned c = codes[n];
+	unsigned len;
+
+	if (c - 1 < 0x7F) {
+	    *p++ = UChar(c);
+	} else if ((len = lengthUTF8(c)) != 0) {
+	    p = encodeUTF8(p, c, len);
+	} else {
+	    discardUTF8(is, c);
+	}
+    }
+    is->outbuf_count = (size_t) (p - is->outbuf);
+}
+
+/*
+ * Encode a run of decoded characters in UTF-16 or UTF-32, discarding null
+ * codepoints and those beyond the range of Unicode.
+ */
+static void
+outbufWideRun(Iso2022Ptr is, int fd, const unsigned *codes, size_t count)
+{
+    unsigned char *p;
+    size_t n;
+
+    OUTBUF_MAKE_FREE(is, fd, 4 * count);
+    p = is->outbuf + is->outbuf_count;
+    for (n = 0; n < count; ++n) {
+	unsigned c = codes[n];
+
+	if (c != 0 && c <= 0x10FFFF)
+	    p = encodeWide(p, c, is->outputEncoding);
+	else
+	    is->stats.dropped++;
+    }
+    is->outbuf_count = (size_t) (p - is->outbuf);
+}
+
 static void
 buffer(Iso2022Ptr is, unsigned c)
 {
@@ -187,35 +471,48 @@ buffer(Iso2022Ptr is, unsigned c)
     is->buffered[is->buffered_count++] = UChar(c);
 }
 
+/*
+ * Copy a span of data to the output, flushing the buffer as it fills.
+ */
 static void
-outbuf_buffered_carefully(Iso2022Ptr is, int fd)
+outbuf_span(Iso2022Ptr is, int fd, const unsigned char *data, size_t count)
 {
-    /* This should never happen in practice */
-    unsigned i = 0;
+    if (OE_WIDE(is)) {
+	outbufWideBytes(is, fd, data, count);
+	return;
+    }
+    while (count != 0) {
+	size_t room = OUTBUF_SIZE - is->outbuf_count;
 
-    while (i < is->buffered_count) {
-	OUTBUF_MAKE_FREE(is, fd, 1);
-	is->outbuf[is->outbuf_count++] = is->buffered[i++];
+	if (room == 0) {
+	    outbuf_flush(is, fd);
+	    continue;
+	}
+	if (room > count)
+	    room = count;
+	memcpy(is->outbuf + is->outbuf_count, data, room);
+	is->outbuf_count += room;
+	data += room;
+	count -= room;
     }
-    is->buffered_count = 0;
 }
 
+/*
+ * Copy an escape sequence to the output, either from the input span or from
+ * the buffer which holds a sequence split across reads.
+ */
 static void
-outbuf_buffered(Iso2022Ptr is, int fd)
+outbuf_sequence(Iso2022Ptr is, int fd, const unsigned char *seq, unsigned count)
 {
-    if (is->buffered_count > BUFFER_SIZE)
-	outbuf_buffered_carefully(is, fd);
-
-    OUTBUF_MAKE_FREE(is, fd, is->buffered_count);
-    memcpy(is->outbuf + is->outbuf_count, is->buffered, is->buffered_count);
-    is->outbuf_count += is->buffered_count;
-    is->buffered_count = 0;
-}
+    if (count > OUTBUF_SIZE || OE_WIDE(is)) {
+	/* Long sequences should never happen in practice */
+	outbuf_span(is, fd, seq, count);
+	return;
+    }
 
-static void
-discard_buffered(Iso2022Ptr is)
-{
-    is->buffered_count = 0;
+    OUTBUF_MAKE_FREE(is, fd, count);
+    memcpy(is->outbuf + is->outbuf_count, seq, count);
+    is->outbuf_count += count;
 }
 
 Iso2022Ptr
@@ -239,14 +536,32 @@ allocIso2022(void)
     is->buffered_count = 0;
 
     is->buffered_ku = -1;
+    is->stats.started = statsNow();
 
-    is->outbuf = malloc((size_t) BUFFER_SIZE);
+    is->outbuf = malloc((size_t) OUTBUF_SIZE);
     if (!is->outbuf) {
 	free(is);
 	return NULL;
     }
     is->outbuf_count = 0;
 
+    is->queue = malloc((size_t) QUEUE_SIZE);
+    if (!is->queue) {
+	free(is->outbuf);
+	free(is);
+	return NULL;
+    }
+    is->queue_head = 0;
+    is->queue_count = 0;
+
+    is->flush_delay = 0;
+    is->flush_bytes = OUTBUF_SIZE;
+    is->flush_now = 0;
+    is->flush_due.tv_sec = 0;
+    is->flush_due.tv_usec = 0;
+
+    is->input_map = NULL;
+
     return is;
 }
 
@@ -254,10 +569,15 @@ allocIso2022(void)
 void
 destroyIso2022(Iso2022Ptr is)
 {
+    freeInputMap(is);
+    if (is->target)
+	destroyIso2022(is->target);
     if (is->buffered)
 	free(is->buffered);
     if (is->outbuf)
 	free(is->outbuf);
+    if (is->queue)
+	free(is->queue);
     free(is);
 }
 #endif
@@ -297,6 +617,104 @@ reportIso2022(const char *tag, Iso2022Ptr i)
     Message("GR is G%d.\n", identifyCharset(i, i->grp));
 }
 
+/*
+ * Move the pending count for the most recently used charset into the table,
+ * and make the given charset the current one.  When the table fills up, the
+ * last slot collects the remaining charsets.
+ */
+static void
+countDecoded(Iso2022Ptr is, const CharsetRec * charset)
+{
+    Iso2022Stats *sp = &(is->stats);
+
+    if (sp->last_charset != NULL && sp->last_count != 0) {
+	int n;
+
+	for (n = 0; n < MAX_STATS_CHARSETS - 1; ++n) {
+	    if (sp->decoded[n].charset == NULL) {
+		sp->decoded[n].charset = sp->last_charset;
+		break;
+	    } else if (sp->decoded[n].charset == sp->last_charset) {
+		break;
+	    }
+	}
+	sp->decoded[n].count += sp->last_count;
+    }
+    sp->last_charset = charset;
+    sp->last_count = 0;
+}
+
+static void
+reportString(FILE *fp, const char *value)
+{
+    fputc('"', fp);
+    while (*value != '\0') {
+	int ch = UChar(*value++);
+	if (ch == '"' || ch == '\\')
+	    fprintf(fp, "\\%c", ch);
+	else if (ch < 0x20 || ch >= 0x7F)
+	    fprintf(fp, "\\u%04x", ch);
+	else
+	    fputc(ch, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * Write the counters for one direction as a JSON object member.
+ */
+void
+reportStats(FILE *fp, const char *tag, Iso2022Ptr is)
+{
+    Iso2022Stats *sp = &(is->stats);
+    const char *sep = "";
+    int n;
+    double elapsed = statsNow() - sp->started;
+
+    countDecoded(is, sp->last_charset);
+
+    reportString(fp, tag);
+    fprintf(fp, ": {");
+    fprintf(fp, "\"bytes_in\": %lu, ", sp->bytes_in);
+    fprintf(fp, "\"bytes_out\": %lu, ", sp->bytes_out);
+    fprintf(fp, "\"decoded\": {");
+    for (n = 0; n < MAX_STATS_CHARSETS; ++n) {
+	if (sp->decoded[n].count == 0)
+	    continue;
+	fputs(sep, fp);
+	reportString(fp, ((sp->decoded[n].charset != NULL)
+			  ? NonNull(sp->decoded[n].charset->name)
+			  : "other"));
+	fprintf(fp, ": %lu", sp->decoded[n].count);
+	sep = ", ";
+    }
+    fprintf(fp, "}, ");
+    fprintf(fp, "\"dropped\": %lu, ", sp->dropped);
+    fprintf(fp, "\"pastes\": %lu, ", sp->pastes);
+    fprintf(fp, "\"paste_bytes\": %lu, ", sp->paste_bytes);
+    fprintf(fp, "\"sequences\": {");
+    fprintf(fp, "\"single_shift\": %lu, ", sp->seq_ss);
+    fprintf(fp, "\"locking_shift\": %lu, ", sp->seq_ls);
+    fprintf(fp, "\"csi\": %lu, ", sp->seq_csi);
+    fprintf(fp, "\"designation\": %lu, ", sp->seq_select);
+    fprintf(fp, "\"other\": %lu, ", sp->seq_other);
+    fprintf(fp, "\"in_place\": %lu, ", sp->seq_spans);
+    fprintf(fp, "\"buffered\": %lu, ", sp->seq_buffered);
+    fprintf(fp, "\"string\": %lu, ", sp->seq_string);
+    fprintf(fp, "\"string_bytes\": %lu, ", sp->string_bytes);
+    fprintf(fp, "\"per_second\": %.1f", ((elapsed > 0.0)
+					  ? ((double) (sp->seq_spans
+						       + sp->seq_buffered)
+					     / elapsed)
+					  : 0.0));
+    fprintf(fp, "}, ");
+    fprintf(fp, "\"flushes\": %lu, ", sp->flushes);
+    fprintf(fp, "\"short_writes\": %lu, ", sp->short_writes);
+    fprintf(fp, "\"waits\": %lu, ", sp->waits);
+    fprintf(fp, "\"blocked\": %.6f", sp->blocked);
+    fprintf(fp, "}");
+}
+
 int
 initIso2022(const char *locale, const char *charset, Iso2022Ptr i)
 {
@@ -422,7 +840,7 @@ fromUtf8(unsigned char *b)
 		((b[1] & 0x3F) << 6) |
 		((b[2] & 0x3F)));
     else if ((b[0] & 0x78) == 0x70)
-	return (((b[0] & 0x03) << 18) |
+	return (((b[0] & 0x07) << 18) |
 		((b[1] & 0x3F) << 12) |
 		((b[2] & 0x3F) << 6) |
 		((b[3] & 0x3F)));
@@ -430,91 +848,32 @@ fromUtf8(unsigned char *b)
 	return -1;
 }
 
-void
-copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
+/*
+ * Compute the bytes which represent the given Unicode value on input, using
+ * the current charsets and input flags.  Returns the number of bytes, or zero
+ * if the value cannot be mapped.
+ */
+static unsigned
+compileInputCode(Iso2022Ptr is, unsigned ucode, unsigned char *obuf)
 {
-    unsigned char *c;
-    int codepoint, rem;
-
-    c = buf;
-    rem = count;
-
-#define NEXT do {c++; rem--;} while(0)
-
-    while (rem > 0) {
-	codepoint = -1;
-	if (is->parserState == P_ESC) {
-	    assert(buffered_input_count == 0);
-	    codepoint = *c;
-	    NEXT;
-	    if (*c == CSI_7)
-		is->parserState = P_CSI;
-	    else if (IS_FINAL_ESC(codepoint))
-		is->parserState = P_NORMAL;
-	} else if (is->parserState == P_CSI) {
-	    assert(buffered_input_count == 0);
-	    codepoint = *c;
-	    NEXT;
-	    if (IS_FINAL_CSI(codepoint))
-		is->parserState = P_NORMAL;
-	} else if (!(*c & 0x80)) {
-	    if (buffered_input_count > 0) {
-		buffered_input_count = 0;
-		continue;
-	    } else {
-		codepoint = *c;
-		NEXT;
-		if (codepoint == ESC)
-		    is->parserState = P_ESC;
-	    }
-	} else if ((*c & 0x40)) {
-	    if (buffered_input_count > 0) {
-		buffered_input_count = 0;
-		continue;
-	    } else {
-		buffered_input[buffered_input_count] = *c;
-		buffered_input_count++;
-		NEXT;
-	    }
-	} else {
-	    if (buffered_input_count <= 0) {
-		buffered_input_count = 0;
-		NEXT;
-		continue;
-	    } else {
-		buffered_input[buffered_input_count] = *c;
-		buffered_input_count++;
-		NEXT;
-		if (buffered_input_count >= utf8Count(buffered_input[0])) {
-		    codepoint = fromUtf8(buffered_input);
-		    buffered_input_count = 0;
-		    if (codepoint == CSI)
-			is->parserState = P_CSI;
-		}
-	    }
-	}
-#undef NEXT
-
-	if (codepoint >= 0) {
-	    int i;
-	    unsigned ucode = (unsigned) codepoint;
-	    unsigned char obuf[4];
+    unsigned result = 0;
+    int i;
 
 #define WRITE_1(i) do { \
 	    obuf[0] = UChar(i); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 1)); \
+	    result = 1; \
 	} while(0)
 #define WRITE_2(i) do { \
 	    obuf[0] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[1] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 2)); \
+	    result = 2; \
 	} while(0)
 
 #define WRITE_3(i) do { \
 	    obuf[0] = UChar(((i) >> 16) & 0xFF); \
 	    obuf[1] = UChar(((i) >>  8) & 0xFF); \
 	    obuf[2] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    result = 3; \
 	} while(0)
 
 #define WRITE_4(i) do { \
@@ -522,20 +881,20 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[1] = UChar(((i) >> 16) & 0xFF); \
 	    obuf[2] = UChar(((i) >>  8) & 0xFF); \
 	    obuf[3] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 4)); \
+	    result = 4; \
        } while(0)
 
 #define WRITE_1_P_8bit(p, i) { \
 	    obuf[0] = UChar(p); \
 	    obuf[1] = UChar(i); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 2)); \
+	    result = 2; \
 	}
 
 #define WRITE_1_P_7bit(p, i) { \
 	    obuf[0] = ESC; \
 	    obuf[1] = UChar((p) - 0x40); \
 	    obuf[2] = UChar(i); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    result = 3; \
 	}
 
 #define WRITE_1_P(p,i) do { \
@@ -548,7 +907,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[0] = UChar(p); \
 	    obuf[1] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[2] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    result = 3; \
 	}
 
 #define WRITE_2_P_7bit(p, i) { \
@@ -556,7 +915,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[1] = UChar((p) - 0x40); \
 	    obuf[2] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[3] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 4)); \
+	    result = 4; \
 	}
 
 #define WRITE_2_P(p,i) do { \
@@ -570,7 +929,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[0] = UChar(p); \
 	    obuf[1] = UChar((i) & 0xFF); \
 	    obuf[2] = UChar(s); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    result = 3; \
 	} while(0)
 
 #define WRITE_2_P_S(p,i,s) do { \
@@ -578,201 +937,838 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[1] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[2] = UChar((i) & 0xFF); \
 	    obuf[3] = UChar(s); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 4)); \
+	    result = 4; \
 	} while(0)
 
-	    if (ucode < 0x20 ||
-		(OTHER(is) == NULL && CHARSET_REGULAR(GR(is)) &&
-		 (ucode >= 0x80 && ucode < 0xA0))) {
-		WRITE_1(ucode);
-		continue;
-	    }
-	    if (OTHER(is) != NULL
-		&& OTHER(is)->other_reverse != NULL) {
-		unsigned int c2;
-		c2 = OTHER(is)->other_reverse(ucode, OTHER(is)->other_aux);
-		if (c2 >> 24)
-		    WRITE_4(c2);
-		else if (c2 >> 16)
-		    WRITE_3(c2);
-		else if (c2 >> 8)
-		    WRITE_2(c2);
-		else if (c2)
-		    WRITE_1(c2);
-		continue;
+    if (ucode < 0x20 ||
+	(OTHER(is) == NULL && CHARSET_REGULAR(GR(is)) &&
+	 (ucode >= 0x80 && ucode < 0xA0))) {
+	WRITE_1(ucode);
+	return result;
+    }
+    if (OTHER(is) != NULL
+	&& OTHER(is)->other_reverse != NULL) {
+	unsigned int c2;
+	c2 = OTHER(is)->other_reverse(ucode, OTHER(is)->other_aux);
+	if (c2 >> 24)
+	    WRITE_4(c2);
+	else if (c2 >> 16)
+	    WRITE_3(c2);
+	else if (c2 >> 8)
+	    WRITE_2(c2);
+	else if (c2)
+	    WRITE_1(c2);
+	return result;
+    }
+    i = (GL(is)->reverse) (ucode, GL(is));
+    if (i >= 0) {
+	switch (GL(is)->type) {
+	case T_94:
+	case T_96:
+	case T_128:
+	    if (i >= 0x20)
+		WRITE_1(i);
+	    break;
+	case T_9494:
+	case T_9696:
+	case T_94192:
+	    if (i >= 0x2020)
+		WRITE_2(i);
+	    break;
+	default:
+	    abort();
+	    /* NOTREACHED */
+	}
+	return result;
+    }
+    if (is->inputFlags & IF_EIGHTBIT) {
+	i = GR(is)->reverse(ucode, GR(is));
+	if (i >= 0) {
+	    switch (GR(is)->type) {
+	    case T_94:
+	    case T_96:
+	    case T_128:
+		/* we allow C1 characters if T_128 in GR */
+		WRITE_1(i | 0x80);
+		break;
+	    case T_9494:
+	    case T_9696:
+		WRITE_2(i | 0x8080);
+		break;
+	    case T_94192:
+		WRITE_2(i | 0x8000);
+		break;
+	    default:
+		abort();
+		/* NOTREACHED */
 	    }
-	    i = (GL(is)->reverse) (ucode, GL(is));
-	    if (i >= 0) {
-		switch (GL(is)->type) {
-		case T_94:
-		case T_96:
-		case T_128:
-		    if (i >= 0x20)
-			WRITE_1(i);
-		    break;
-		case T_9494:
-		case T_9696:
-		case T_94192:
-		    if (i >= 0x2020)
-			WRITE_2(i);
-		    break;
-		default:
-		    abort();
-		    /* NOTREACHED */
+	    return result;
+	}
+    }
+    if (is->inputFlags & IF_SS) {
+	i = G2(is)->reverse(ucode, G2(is));
+	if (i >= 0) {
+	    switch (GR(is)->type) {
+	    case T_94:
+	    case T_96:
+	    case T_128:
+		if (i >= 0x20) {
+		    if ((is->inputFlags & IF_EIGHTBIT) &&
+			(is->inputFlags & IF_SSGR))
+			i |= 0x80;
+		    WRITE_1_P(SS2, i);
 		}
-		continue;
-	    }
-	    if (is->inputFlags & IF_EIGHTBIT) {
-		i = GR(is)->reverse(ucode, GR(is));
-		if (i >= 0) {
-		    switch (GR(is)->type) {
-		    case T_94:
-		    case T_96:
-		    case T_128:
-			/* we allow C1 characters if T_128 in GR */
-			WRITE_1(i | 0x80);
-			break;
-		    case T_9494:
-		    case T_9696:
-			WRITE_2(i | 0x8080);
-			break;
-		    case T_94192:
-			WRITE_2(i | 0x8000);
-			break;
-		    default:
-			abort();
-			/* NOTREACHED */
-		    }
-		    continue;
+		break;
+	    case T_9494:
+	    case T_9696:
+		if (i >= 0x2020) {
+		    if ((is->inputFlags & IF_EIGHTBIT) &&
+			(is->inputFlags & IF_SSGR))
+			i |= 0x8080;
+		    WRITE_2_P(SS2, i);
+		}
+		break;
+	    case T_94192:
+		if (i >= 0x2020) {
+		    if ((is->inputFlags & IF_EIGHTBIT) &&
+			(is->inputFlags & IF_SSGR))
+			i |= 0x8000;
+		    WRITE_2_P(SS2, i);
 		}
+		break;
+	    default:
+		abort();
+		/* NOTREACHED */
 	    }
-	    if (is->inputFlags & IF_SS) {
-		i = G2(is)->reverse(ucode, G2(is));
-		if (i >= 0) {
-		    switch (GR(is)->type) {
-		    case T_94:
-		    case T_96:
-		    case T_128:
-			if (i >= 0x20) {
-			    if ((is->inputFlags & IF_EIGHTBIT) &&
-				(is->inputFlags & IF_SSGR))
-				i |= 0x80;
-			    WRITE_1_P(SS2, i);
-			}
-			break;
-		    case T_9494:
-		    case T_9696:
-			if (i >= 0x2020) {
-			    if ((is->inputFlags & IF_EIGHTBIT) &&
-				(is->inputFlags & IF_SSGR))
-				i |= 0x8080;
-			    WRITE_2_P(SS2, i);
-			}
-			break;
-		    case T_94192:
-			if (i >= 0x2020) {
-			    if ((is->inputFlags & IF_EIGHTBIT) &&
-				(is->inputFlags & IF_SSGR))
-				i |= 0x8000;
-			    WRITE_2_P(SS2, i);
-			}
-			break;
-		    default:
-			abort();
-			/* NOTREACHED */
-		    }
-		    continue;
-		}
+	    return result;
+	}
+    }
+    if (is->inputFlags & IF_SS) {
+	i = G3(is)->reverse(ucode, G3(is));
+	switch (GR(is)->type) {
+	case T_94:
+	case T_96:
+	case T_128:
+	    if (i >= 0x20) {
+		if ((is->inputFlags & IF_EIGHTBIT) &&
+		    (is->inputFlags & IF_SSGR))
+		    i |= 0x80;
+		WRITE_1_P(SS3, i);
 	    }
-	    if (is->inputFlags & IF_SS) {
-		i = G3(is)->reverse(ucode, G3(is));
-		switch (GR(is)->type) {
-		case T_94:
-		case T_96:
-		case T_128:
-		    if (i >= 0x20) {
-			if ((is->inputFlags & IF_EIGHTBIT) &&
-			    (is->inputFlags & IF_SSGR))
-			    i |= 0x80;
-			WRITE_1_P(SS3, i);
-		    }
-		    break;
-		case T_9494:
-		case T_9696:
-		    if (i >= 0x2020) {
-			if ((is->inputFlags & IF_EIGHTBIT) &&
-			    (is->inputFlags & IF_SSGR))
-			    i |= 0x8080;
-			WRITE_2_P(SS3, i);
-		    }
-		    break;
-		case T_94192:
-		    if (i >= 0x2020) {
-			if ((is->inputFlags & IF_EIGHTBIT) &&
-			    (is->inputFlags & IF_SSGR))
-			    i |= 0x8000;
-			WRITE_2_P(SS3, i);
-		    }
-		    break;
-		default:
-		    abort();
-		    /* NOTREACHED */
-		}
-		continue;
+	    break;
+	case T_9494:
+	case T_9696:
+	    if (i >= 0x2020) {
+		if ((is->inputFlags & IF_EIGHTBIT) &&
+		    (is->inputFlags & IF_SSGR))
+		    i |= 0x8080;
+		WRITE_2_P(SS3, i);
 	    }
-	    if (is->inputFlags & IF_LS) {
-		i = GR(is)->reverse(ucode, GR(is));
-		if (i >= 0) {
-		    switch (GR(is)->type) {
-		    case T_94:
-		    case T_96:
-		    case T_128:
-			WRITE_1_P_S(LS1, i, LS0);
-			break;
-		    case T_9494:
-		    case T_9696:
-			WRITE_2_P_S(LS1, i, LS0);
-			break;
-		    case T_94192:
-			WRITE_2_P_S(LS1, i, LS0);
-			break;
-		    default:
-			abort();
-			/* NOTREACHED */
-		    }
-		    continue;
-		}
+	    break;
+	case T_94192:
+	    if (i >= 0x2020) {
+		if ((is->inputFlags & IF_EIGHTBIT) &&
+		    (is->inputFlags & IF_SSGR))
+		    i |= 0x8000;
+		WRITE_2_P(SS3, i);
+	    }
+	    break;
+	default:
+	    abort();
+	    /* NOTREACHED */
+	}
+	return result;
+    }
+    if (is->inputFlags & IF_LS) {
+	i = GR(is)->reverse(ucode, GR(is));
+	if (i >= 0) {
+	    switch (GR(is)->type) {
+	    case T_94:
+	    case T_96:
+	    case T_128:
+		WRITE_1_P_S(LS1, i, LS0);
+		break;
+	    case T_9494:
+	    case T_9696:
+		WRITE_2_P_S(LS1, i, LS0);
+		break;
+	    case T_94192:
+		WRITE_2_P_S(LS1, i, LS0);
+		break;
+	    default:
+		abort();
+		/* NOTREACHED */
 	    }
+	    return result;
+	}
+    }
 #undef WRITE_1
 #undef WRITE_2
+#undef WRITE_3
+#undef WRITE_4
 #undef WRITE_1_P
 #undef WRITE_1_P_7bit
 #undef WRITE_1_P_8bit
 #undef WRITE_2_P
 #undef WRITE_2_P_7bit
 #undef WRITE_2_P_8bit
+#undef WRITE_1_P_S
+#undef WRITE_2_P_S
+    return result;
+}
+
+static void
+freeInputMap(Iso2022Ptr is)
+{
+    if (is->input_map != NULL) {
+	unsigned n;
+	for (n = 0; n < INPUT_PAGES; ++n) {
+	    if (is->input_map[n] != NULL)
+		free(is->input_map[n]);
+	}
+	free(is->input_map);
+	is->input_map = NULL;
+    }
+}
+
+/*
+ * The cached input codes depend only on the charsets and the input flags.
+ * Discard the cache if any of those have changed since it was built.
+ */
+static void
+checkInputMap(Iso2022Ptr is)
+{
+    InputKeyRec *key = &(is->input_key);
+
+    if (is->input_map != NULL
+	&& (memcmp(key->g, is->g, sizeof(key->g))
+	    || key->other != OTHER(is)
+	    || key->glp != is->glp
+	    || key->grp != is->grp
+	    || key->inputFlags != is->inputFlags)) {
+	TRACE(("checkInputMap: discarding cache\n"));
+	freeInputMap(is);
+    }
+    if (is->input_map == NULL) {
+	is->input_map = TypeCallocN(InputCodePtr, INPUT_PAGES);
+	if (is->input_map == NULL)
+	    FatalError("Couldn't allocate input map.\n");
+	memcpy(key->g, is->g, sizeof(key->g));
+	key->other = OTHER(is);
+	key->glp = is->glp;
+	key->grp = is->grp;
+	key->inputFlags = is->inputFlags;
+    }
+}
+
+static const InputCodeRec *
+lookupInputCode(Iso2022Ptr is, unsigned ucode)
+{
+    static InputCodeRec scratch;
+    unsigned page = ucode / INPUT_PAGE_SIZE;
+    InputCodePtr codes;
+
+    if (page >= INPUT_PAGES) {
+	scratch.length = UChar(compileInputCode(is, ucode, scratch.text));
+	return &scratch;
+    }
+    if ((codes = is->input_map[page]) == NULL) {
+	unsigned n;
+
+	codes = TypeCallocN(InputCodeRec, INPUT_PAGE_SIZE);
+	if (codes == NULL)
+	    FatalError("Couldn't allocate input map page.\n");
+	TRACE(("lookupInputCode: compiling page %#x\n", page));
+	for (n = 0; n < INPUT_PAGE_SIZE; ++n) {
+	    InputCodePtr code = &codes[n];
+	    code->length = UChar(compileInputCode(is,
+						  (page * INPUT_PAGE_SIZE) + n,
+						  code->text));
 	}
+	is->input_map[page] = codes;
+    }
+    return &codes[ucode % INPUT_PAGE_SIZE];
+}
+
+static void
+putInputCode(Iso2022Ptr is, int fd, unsigned codepoint)
+{
+    const InputCodeRec *code = lookupInputCode(is, codepoint);
+
+    if (code->length != 0) {
+	if (!OUTBUF_FREE(is, code->length))
+	    outbuf_write(is, fd);
+	memcpy(is->outbuf + is->outbuf_count, code->text, code->length);
+	is->outbuf_count += code->length;
+    } else {
+	is->stats.dropped++;
     }
 }
 
+/*
+ * Encode a run of decoded characters in a legacy encoding, using the codes
+ * compiled from the reverse mappings of its charsets, as copyIn does.
+ */
+static void
+outbufOtherRun(Iso2022Ptr is, int fd, const unsigned *codes, size_t count)
+{
+    size_t n;
+
+    OUTBUF_MAKE_FREE(is, fd, sizeof(((InputCodeRec *) 0)->text) * count);
+    for (n = 0; n < count; ++n) {
+	const InputCodeRec *code;
+
+	if (codes[n] != 0
+	    && (code = lookupInputCode(is->target, codes[n]))->length != 0) {
+	    memcpy(is->outbuf + is->outbuf_count, code->text, code->length);
+	    is->outbuf_count += code->length;
+	} else {
+	    is->stats.dropped++;
+	}
+    }
+}
+
+/*
+ * The encoding stage: write a run of decoded characters in the output
+ * encoding.
+ */
+static void
+outbufRun(Iso2022Ptr is, int fd, const unsigned *codes, size_t count)
+{
+    TRACE_EVENT((evENCODE, (unsigned) count, (unsigned) is->outputEncoding, 0));
+    switch (is->outputEncoding) {
+    case OE_UTF8:
+	outbufUTF8Run(is, fd, codes, count);
+	break;
+    case OE_OTHER:
+	outbufOtherRun(is, fd, codes, count);
+	break;
+    default:
+	outbufWideRun(is, fd, codes, count);
+	break;
+    }
+}
+
+/* Write one decoded character in the output encoding */
+static void
+outbufCode(Iso2022Ptr is, int fd, unsigned c)
+{
+    if (is->outputEncoding == OE_UTF8)
+	outbufUTF8(is, fd, c);
+    else
+	outbufRun(is, fd, &c, (size_t) 1);
+}
+
+/* *INDENT-OFF* */
+static const struct {
+    const char *name;
+    int code;
+} output_encodings[] = {
+    { "UTF-8",		OE_UTF8 },
+    { "UTF-16",		OE_UTF16BE },
+    { "UTF-16BE",	OE_UTF16BE },
+    { "UTF-16LE",	OE_UTF16LE },
+    { "UTF-32",		OE_UTF32BE },
+    { "UTF-32BE",	OE_UTF32BE },
+    { "UTF-32LE",	OE_UTF32LE },
+};
+/* *INDENT-ON* */
+
+/*
+ * Select the encoding which copyOut writes, for converter mode.  The Unicode
+ * encodings are written directly, and others using the reverse mappings of
+ * their charsets.  Returns -1 if the encoding is not known.
+ */
+int
+setOutputEncoding(Iso2022Ptr is, const char *name)
+{
+    int result = -1;
+    size_t n;
+
+    for (n = 0; n < SizeOf(output_encodings); ++n) {
+	if (!lcStrCmp(name, output_encodings[n].name)) {
+	    is->outputEncoding = output_encodings[n].code;
+	    result = 0;
+	    break;
+	}
+    }
+    if (result < 0) {
+	int gl = 0, gr = 2;
+	const CharsetRec *g0, *g1, *g2, *g3, *other;
+	Iso2022Ptr target;
+
+	if (getLocaleState(name, name, &gl, &gr, &g0, &g1, &g2, &g3, &other) >= 0
+	    && (target = allocIso2022()) != NULL) {
+	    initIso2022(name, name, target);
+	    checkInputMap(target);
+	    is->target = target;
+	    is->outputEncoding = OE_OTHER;
+	    result = 0;
+	}
+    }
+    TRACE(("setOutputEncoding(%s) ->%d\n", name, is->outputEncoding));
+    return result;
+}
+
+/*
+ * Convert the body of a bracketed paste, up to the next escape sequence, or
+ * anything which the per-character loop in copyIn must handle, such as a
+ * character split across reads.  Returns the number of bytes used.
+ */
+static int
+copyPaste(Iso2022Ptr is, int fd, unsigned char *s, int count)
+{
+    int n = 0;
+
+    while (n < count) {
+	unsigned c = s[n];
+	int len = 1;
+
+	if (c == ESC) {
+	    break;
+	} else if (c >= 0x80) {
+	    int k;
+	    int codepoint;
+
+	    len = utf8Count(c);
+	    if (len < 2 || n + len > count)
+		break;
+	    for (k = 1; k < len; ++k) {
+		if ((s[n + k] & 0xC0) != 0x80)
+		    break;
+	    }
+	    if (k < len)
+		break;
+	    if ((codepoint = fromUtf8(s + n)) < 0 || codepoint == CSI)
+		break;
+	    c = (unsigned) codepoint;
+	}
+	putInputCode(is, fd, c);
+	n += len;
+    }
+    return n;
+}
+
+/*
+ * Note the beginning or end of a bracketed paste, i.e., CSI 200 ~ or
+ * CSI 201 ~ from the terminal.  Those are passed to the application.
+ */
+static void
+checkPaste(Iso2022Ptr is, unsigned long where)
+{
+    if (is->csi_param == 200 && !is->pasting) {
+	is->pasting = 1;
+	is->paste_start = where;
+	is->paste_time = 0.0;
+	is->stats.pastes++;
+    } else if (is->csi_param == 201 && is->pasting) {
+	unsigned long size = is->seq_start - is->paste_start;
+
+	is->pasting = 0;
+	is->stats.paste_bytes += size;
+	VERBOSE(1, ("paste of %lu bytes, %.3f msecs converting\n",
+		    size, is->paste_time * 1000.0));
+    }
+}
+
+void
+copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
+{
+    unsigned char *c;
+    int codepoint, rem;
+
+    c = buf;
+    rem = count;
+
+    TRACE_EVENT((evCOPY_IN, (unsigned) fd, (unsigned) count, 0));
+    is->stats.bytes_in += (unsigned long) count;
+    checkInputMap(is);
+
+#define NEXT do {c++; rem--;} while(0)
+
+    while (rem > 0) {
+	codepoint = -1;
+	if (is->pasting
+	    && is->parserState == P_NORMAL
+	    && buffered_input_count == 0) {
+	    double start = statsNow();
+	    int used = copyPaste(is, fd, c, rem);
+
+	    is->paste_time += statsNow() - start;
+	    c += used;
+	    rem -= used;
+	    if (rem <= 0)
+		break;
+	}
+	if (is->parserState == P_ESC) {
+	    assert(buffered_input_count == 0);
+	    codepoint = *c;
+	    NEXT;
+	    if (codepoint == CSI_7) {
+		is->parserState = P_CSI;
+		is->csi_param = 0;
+	    } else if (IS_FINAL_ESC(codepoint)) {
+		is->parserState = P_NORMAL;
+	    }
+	} else if (is->parserState == P_CSI) {
+	    assert(buffered_input_count == 0);
+	    codepoint = *c;
+	    NEXT;
+	    if (codepoint >= '0' && codepoint <= '9') {
+		if (is->csi_param < 10000)
+		    is->csi_param = ((is->csi_param * 10)
+				     + (unsigned) (codepoint - '0'));
+	    } else if (codepoint == ';') {
+		is->csi_param = 0;
+	    } else if (IS_FINAL_CSI(codepoint)) {
+		is->parserState = P_NORMAL;
+		if (codepoint == '~')
+		    checkPaste(is, is->stats.bytes_in - (unsigned long) rem);
+	    }
+	} else if (!(*c & 0x80)) {
+	    if (buffered_input_count > 0) {
+		buffered_input_count = 0;
+		continue;
+	    } else {
+		codepoint = *c;
+		NEXT;
+		if (codepoint == ESC) {
+		    is->parserState = P_ESC;
+		    is->seq_start = is->stats.bytes_in - (unsigned long) (rem + 1);
+		}
+	    }
+	} else if ((*c & 0x40)) {
+	    if (buffered_input_count > 0) {
+		buffered_input_count = 0;
+		continue;
+	    } else {
+		buffered_input[buffered_input_count] = *c;
+		buffered_input_count++;
+		NEXT;
+	    }
+	} else {
+	    if (buffered_input_count <= 0) {
+		buffered_input_count = 0;
+		NEXT;
+		continue;
+	    } else {
+		buffered_input[buffered_input_count] = *c;
+		buffered_input_count++;
+		NEXT;
+		if (buffered_input_count >= utf8Count(buffered_input[0])) {
+		    codepoint = fromUtf8(buffered_input);
+		    buffered_input_count = 0;
+		    if (codepoint == CSI) {
+			is->parserState = P_CSI;
+			is->csi_param = 0;
+			is->seq_start = (is->stats.bytes_in
+					 - (unsigned long) (rem + 2));
+		    }
+		}
+	    }
+	}
+#undef NEXT
+
+	if (codepoint >= 0)
+	    putInputCode(is, fd, (unsigned) codepoint);
+    }
+    outbuf_write(is, fd);
+}
+
 #define PAIR(a,b) ((unsigned) ((a) << 8) | (b))
 
+/*
+ * Return the length of the escape or control sequence starting at s, if it
+ * ends before the end of the span, or zero if it does not.  This follows the
+ * same states as the P_ESC and P_CSI cases of copyOut.
+ */
+static unsigned
+scanSequence(const unsigned char *s, const unsigned char *end, int csi)
+{
+    const unsigned char *p = s + 1;
+
+    while (p < end) {
+	unsigned c = *p++;
+	if (csi) {
+	    if (IS_FINAL_CSI(c))
+		return (unsigned) (p - s);
+	} else if (c == CSI_7) {
+	    csi = 1;
+	} else if (IS_FINAL_ESC(c)) {
+	    return (unsigned) (p - s);
+	}
+    }
+    return 0;
+}
+
+/*
+ * Copy the body of a control string to the output without conversion, up to
+ * the string terminator, or anything which cancels the string.  A 7-bit ST
+ * (ESC \) is left for the caller to handle as an escape sequence.  Only
+ * 7-bit data is passed through: any other byte ends the string, and is
+ * converted as text.
+ */
+static unsigned char *
+copyString(Iso2022Ptr is, int fd, unsigned char *s, unsigned char *end)
+{
+    unsigned char *p = s;
+    int eight = (OTHER(is) == NULL && CHARSET_REGULAR(GR(is)));
+
+    while (p < end) {
+	unsigned c = *p;
+	if (c == ESC
+	    || c == CAN
+	    || c == SUB
+	    || (c == BEL && is->string_osc)
+	    || c >= 0x80)
+	    break;
+	++p;
+    }
+    outbuf_span(is, fd, s, (size_t) (p - s));
+    is->stats.string_bytes += (unsigned long) (p - s);
+
+    if (p < end) {
+	is->parserState = P_NORMAL;
+	if (*p == BEL)
+	    outbufOne(is, fd, *p++);
+	else if (*p == ST && eight)
+	    outbufCode(is, fd, *p++);
+    }
+    return p;
+}
+
+/*
+ * Decode one character of charset, whose first byte is at s.  Returns the
+ * number of bytes used, or zero for a multibyte character which is split
+ * across reads or invalid, leaving that to the parser.
+ */
+static unsigned
+decodeChar(Iso2022Ptr is,
+	   const CharsetRec * charset,
+	   const unsigned char *s,
+	   const unsigned char *end,
+	   unsigned *ucode)
+{
+    unsigned result = 0;
+    unsigned code = (*s & 0x7F);
+    unsigned trail;
+
+    switch (charset->type) {
+    case T_94:
+	*ucode = ((code >= 0x21 && code <= 0x7E)
+		  ? charset->recode(code, charset)
+		  : *s);
+	result = 1;
+	break;
+    case T_96:
+	*ucode = ((code >= 0x20)
+		  ? charset->recode(code, charset)
+		  : *s);
+	result = 1;
+	break;
+    case T_128:
+	*ucode = charset->recode(code, charset);
+	result = 1;
+	break;
+    case T_9494:
+    case T_9696:
+	if (s + 1 < end) {
+	    /* the second byte must be in the same half as the first */
+	    trail = (((s[1] ^ *s) & 0x80) ? 0 : (s[1] & 0x7F));
+	    if ((charset->type == T_9494)
+		? (trail >= 0x21 && trail <= 0x7E)
+		: (trail >= 0x20)) {
+		*ucode = charset->recode(PAIR(code, trail), charset);
+		result = 2;
+	    }
+	}
+	break;
+    case T_94192:
+	if (s + 1 < end
+	    && (((s[1] >= 0x21) && (s[1] <= 0x7E)) ||
+		((s[1] >= 0xA1) && (s[1] <= 0xFE)))) {
+	    *ucode = charset->recode(PAIR(code, s[1]), charset);
+	    result = 2;
+	}
+	break;
+    }
+    if (result != 0)
+	COUNT_DECODED(is, charset);
+    return result;
+}
+
+/*
+ * The controls which copyOut handles as shifts or the start of a string,
+ * when GR is not a 128-character set.
+ */
+static int
+isShiftOrString(unsigned c)
+{
+    int result;
+
+    switch (c) {
+    case LS0:
+    case LS1:
+    case SS2:
+    case SS3:
+    case CSI:
+    case DCS:
+    case SOS:
+    case OSC:
+    case PM:
+    case APC:
+	result = 1;
+	break;
+    default:
+	result = 0;
+	break;
+    }
+    return result;
+}
+
+/*
+ * Decode a character preceded by a single shift, counting the shift as
+ * terminate would.  Returns the number of bytes used, including the shift,
+ * or zero to leave it to the parser.
+ */
+static unsigned
+decodeShifted(Iso2022Ptr is,
+	      const unsigned char *s,
+	      const unsigned char *end,
+	      unsigned *ucode)
+{
+    unsigned result = 0;
+
+    if ((is->outputFlags & (OF_SS | OF_PASSTHRU)) == OF_SS
+	&& s + 1 < end
+	&& s[1] > 0x20
+	&& !isShiftOrString(s[1])
+	&& (result = decodeChar(is,
+				(*s == SS2) ? G2(is) : G3(is),
+				s + 1, end, ucode)) != 0) {
+	is->stats.seq_spans++;
+	countSequence(is, s, 1);
+	++result;
+    }
+    return result;
+}
+
+/*
+ * The decoding stage: decode the text starting at s into a run of up to
+ * RUN_SIZE code points.  It stops at an escape or a control which the parser
+ * must handle, and at anything decodeChar cannot finish.  Returns the
+ * position after the last byte decoded.
+ */
+static unsigned char *
+decodeText(Iso2022Ptr is,
+	   unsigned char *s,
+	   unsigned char *end,
+	   unsigned *run,
+	   size_t *count)
+{
+    const CharsetRec *other = OTHER(is);
+    size_t used = 0;
+
+    if (other != NULL
+	&& other->other_recode != NULL
+	&& other->other_stack != NULL
+	&& other->other_aux != NULL) {
+	while (s < end && *s != ESC && used < RUN_SIZE) {
+	    int c = other->other_stack(*s++, other->other_aux);
+	    if (c >= 0) {
+		COUNT_DECODED(is, other);
+		run[used++] = other->other_recode((unsigned) c, other->other_aux);
+	    }
+	}
+    } else {
+	int regular = CHARSET_REGULAR(GR(is));
+	unsigned ucode = 0;
+	unsigned len = 1;
+
+	while (s < end && used < RUN_SIZE && len != 0) {
+	    unsigned c = *s;
+
+	    if (c == 0 || c == ESC) {
+		len = 0;
+	    } else if (regular && (c == SS2 || c == SS3)) {
+		if ((len = decodeShifted(is, s, end, &ucode)) != 0)
+		    run[used++] = ucode;
+	    } else if (regular && isShiftOrString(c)) {
+		len = 0;
+	    } else if (c <= 0x20) {
+		run[used++] = c;
+		len = 1;
+	    } else if ((len = decodeChar(is,
+					 (c <= 0x7F) ? GL(is) : GR(is),
+					 s, end, &ucode)) != 0) {
+		run[used++] = ucode;
+	    }
+	    s += len;
+	}
+    }
+    *count = used;
+    return s;
+}
+
+/*
+ * Copy a span of text to the output, in runs passed from the decoding stage
+ * to the encoding stage.
+ */
+static unsigned char *
+copyText(Iso2022Ptr is, int fd, unsigned char *s, unsigned char *end)
+{
+    unsigned run[RUN_SIZE];
+    unsigned char *next;
+    size_t used;
+
+    while ((next = decodeText(is, s, end, run, &used)) != s) {
+	TRACE_EVENT((evDECODE, (unsigned) (next - s), (unsigned) used, 0));
+	outbufRun(is, fd, run, used);
+	s = next;
+    }
+    return s;
+}
+
+/*
+ * Handle a sequence which was split across reads, and had to be buffered.
+ */
+static void
+terminateBuffered(Iso2022Ptr is, int fd)
+{
+    is->stats.seq_buffered++;
+    terminate(is, fd, is->buffered, (unsigned) is->buffered_count);
+    is->buffered_count = 0;
+}
+
 void
 copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 {
     unsigned char *s = buf;
+    unsigned char *text;
 
-    if (ilog >= 0)
-	IGNORE_RC(write(ilog, buf, (size_t) count));
+    writeLog(ilog, buf, (size_t) count);
 
+    TRACE_EVENT((evCOPY_OUT, (unsigned) fd, count, 0));
+    is->stats.bytes_in += count;
     while (s < buf + count) {
 	switch (is->parserState) {
 	case P_NORMAL:
 	  resynch:
-	    if (is->buffered_ku < 0) {
+	    if (is->buffered_ku < 0
+		&& is->shiftState == S_NORMAL
+		&& (text = copyText(is, fd, s, buf + count)) != s) {
+		s = text;
+	    } else if (is->buffered_ku < 0) {
 		if (*s == ESC) {
-		    buffer(is, *s++);
-		    is->parserState = P_ESC;
+		    unsigned len = scanSequence(s, buf + count, 0);
+		    if (len != 0) {
+			is->stats.seq_spans++;
+			terminate(is, fd, s, len);
+			s += len;
+		    } else {
+			buffer(is, *s++);
+			is->parserState = P_ESC;
+		    }
 		} else if (OTHER(is) != NULL
 			   && OTHER(is)->other_recode != NULL
 			   && OTHER(is)->other_stack != NULL
@@ -780,22 +1776,35 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    int c = OTHER(is)->other_stack(*s, OTHER(is)->other_aux);
 		    if (c >= 0) {
 			unsigned ucode = (unsigned) c;
-			outbufUTF8(is, fd,
+			COUNT_DECODED(is, OTHER(is));
+			outbufCode(is, fd,
 				   OTHER(is)->other_recode(ucode, OTHER(is)->other_aux));
 			is->shiftState = S_NORMAL;
 		    }
 		    s++;
 		} else if (*s == CSI && CHARSET_REGULAR(GR(is))) {
-		    buffer(is, *s++);
-		    is->parserState = P_CSI;
+		    unsigned len = scanSequence(s, buf + count, 1);
+		    if (len != 0) {
+			is->stats.seq_spans++;
+			terminate(is, fd, s, len);
+			s += len;
+		    } else {
+			buffer(is, *s++);
+			is->parserState = P_CSI;
+		    }
 		} else if ((*s == SS2 ||
 			    *s == SS3 ||
 			    *s == LS0 ||
-			    *s == LS1) &&
+			    *s == LS1 ||
+			    *s == DCS ||
+			    *s == SOS ||
+			    *s == OSC ||
+			    *s == PM ||
+			    *s == APC) &&
 			   CHARSET_REGULAR(GR(is))) {
-		    buffer(is, *s++);
-		    terminate(is, fd);
-		    is->parserState = P_NORMAL;
+		    is->stats.seq_spans++;
+		    terminate(is, fd, s, 1);
+		    s++;
 		} else if (*s <= 0x20 && is->shiftState == S_NORMAL) {
 		    /* Pass through C0 when GL is not regular */
 		    outbufOne(is, fd, *s);
@@ -839,23 +1848,26 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 
 		    switch (charset->type) {
 		    case T_94:
+			COUNT_DECODED(is, charset);
 			if (code >= 0x21 && code <= 0x7E)
-			    outbufUTF8(is, fd, charset->recode(code, charset));
+			    outbufCode(is, fd, charset->recode(code, charset));
 			else
-			    outbufUTF8(is, fd, *s);
+			    outbufCode(is, fd, *s);
 			s++;
 			is->shiftState = S_NORMAL;
 			break;
 		    case T_96:
+			COUNT_DECODED(is, charset);
 			if (code >= 0x20)
-			    outbufUTF8(is, fd, charset->recode(code, charset));
+			    outbufCode(is, fd, charset->recode(code, charset));
 			else
-			    outbufUTF8(is, fd, *s);
+			    outbufCode(is, fd, *s);
 			is->shiftState = S_NORMAL;
 			s++;
 			break;
 		    case T_128:
-			outbufUTF8(is, fd, charset->recode(code, charset));
+			COUNT_DECODED(is, charset);
+			outbufCode(is, fd, charset->recode(code, charset));
 			is->shiftState = S_NORMAL;
 			s++;
 			break;
@@ -915,7 +1927,8 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    break;
 		case T_9494:
 		    if (code >= 0x21 && code <= 0x7E) {
-			outbufUTF8(is, fd,
+			COUNT_DECODED(is, charset);
+			outbufCode(is, fd,
 				   charset->recode(PAIR(ku_code, code), charset));
 			is->buffered_ku = -1;
 			is->shiftState = S_NORMAL;
@@ -928,7 +1941,8 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    break;
 		case T_9696:
 		    if (code >= 0x20) {
-			outbufUTF8(is, fd,
+			COUNT_DECODED(is, charset);
+			outbufCode(is, fd,
 				   charset->recode(PAIR(ku_code, code), charset));
 			is->buffered_ku = -1;
 			is->shiftState = S_NORMAL;
@@ -944,7 +1958,8 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    if (((*s >= 0x21) && (*s <= 0x7E)) ||
 			((*s >= 0xA1) && (*s <= 0xFE))) {
 			unsigned ucode = PAIR(ku_code, *s);
-			outbufUTF8(is, fd,
+			COUNT_DECODED(is, charset);
+			outbufCode(is, fd,
 				   charset->recode(ucode, charset));
 			is->buffered_ku = -1;
 			is->shiftState = S_NORMAL;
@@ -968,8 +1983,8 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		is->parserState = P_CSI;
 	    } else if (IS_FINAL_ESC(*s)) {
 		buffer(is, *s++);
-		terminate(is, fd);
 		is->parserState = P_NORMAL;
+		terminateBuffered(is, fd);
 	    } else {
 		buffer(is, *s++);
 	    }
@@ -977,103 +1992,294 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 	case P_CSI:
 	    if (IS_FINAL_CSI(*s)) {
 		buffer(is, *s++);
-		terminate(is, fd);
 		is->parserState = P_NORMAL;
+		terminateBuffered(is, fd);
 	    } else {
 		buffer(is, *s++);
 	    }
 	    break;
+	case P_OSC:
+	    /* OSC 0 to 3 set titles, etc., from text: convert those */
+	    if (*s >= '0' && *s <= '9') {
+		if (is->string_param < 10000)
+		    is->string_param = ((is->string_param * 10)
+					+ (unsigned) (*s - '0'));
+		is->stats.string_bytes++;
+		outbufOne(is, fd, *s++);
+	    } else {
+		if (*s == ';') {
+		    is->stats.string_bytes++;
+		    outbufOne(is, fd, *s++);
+		}
+		is->parserState = ((is->string_param <= 3)
+				   ? P_NORMAL
+				   : P_STRING);
+	    }
+	    break;
+	case P_STRING:
+	    s = copyString(is, fd, s, buf + count);
+	    break;
 	default:
 	    abort();
 	    /* NOTREACHED */
 	}
     }
-    outbuf_flush(is, fd);
+
+    /*
+     * Unless we are asked to hold output, write it at the end of each chunk.
+     * Otherwise, write it when enough has accumulated, and leave it to the
+     * event loop to write the remainder when the delay has passed.
+     */
+    if (is->flush_delay == 0
+	|| is->flush_now
+	|| is->outbuf_count >= is->flush_bytes) {
+	is->flush_now = 0;
+	outbuf_flush(is, fd);
+    } else if (is->outbuf_count != 0
+	       && is->flush_due.tv_sec == 0
+	       && is->flush_due.tv_usec == 0) {
+	gettimeofday(&(is->flush_due), NULL);
+	is->flush_due.tv_usec += (long) (is->flush_delay * 1000);
+	is->flush_due.tv_sec += is->flush_due.tv_usec / 1000000;
+	is->flush_due.tv_usec %= 1000000;
+    }
+}
+
+/*
+ * Return the number of milliseconds until held output must be written, or
+ * -1 if there is none.
+ */
+int
+pendingIso2022(Iso2022Ptr is)
+{
+    int result = -1;
+
+    if (is->outbuf_count != 0
+	&& (is->flush_due.tv_sec != 0 || is->flush_due.tv_usec != 0)) {
+	struct timeval now;
+	long msecs;
+
+	gettimeofday(&now, NULL);
+	msecs = ((long) (is->flush_due.tv_sec - now.tv_sec) * 1000
+		 + (long) (is->flush_due.tv_usec - now.tv_usec + 999) / 1000);
+	result = (msecs > 0) ? (int) msecs : 0;
+    }
+    return result;
+}
+
+/*
+ * Write any output which is being held.
+ */
+void
+flushIso2022(Iso2022Ptr is, int fd)
+{
+    if (is->outbuf_count != 0)
+	outbuf_flush(is, fd);
+}
+
+/*
+ * Write as much of the queue as the file descriptor will accept.  Returns -1
+ * (discarding the queue) if it cannot be written.
+ */
+int
+drainIso2022(Iso2022Ptr is, int fd)
+{
+    int rc = 0;
+
+    if (is->queue_count != 0) {
+	rc = write_some(is, fd, is->queue + is->queue_head, is->queue_count);
+	if (rc < 0) {
+	    is->queue_head = 0;
+	    is->queue_count = 0;
+	} else {
+	    is->queue_head += (size_t) rc;
+	    is->queue_count -= (size_t) rc;
+	    if (is->queue_count == 0)
+		is->queue_head = 0;
+	    rc = 0;
+	}
+    }
+    return rc;
 }
 
+/*
+ * Write everything, held or queued, waiting as needed.
+ */
+void
+finishIso2022(Iso2022Ptr is, int fd)
+{
+    flushIso2022(is, fd);
+    while (is->queue_count != 0) {
+	if (statsWaitForOutput(is, fd) == IO_Closed
+	    || drainIso2022(is, fd) < 0)
+	    break;
+    }
+}
+
+/*
+ * Classify an escape sequence for the statistics report.
+ */
 static void
-terminate(Iso2022Ptr is, int fd)
+countSequence(Iso2022Ptr is, const unsigned char *seq, unsigned count)
 {
+    unsigned first = seq[0];
+    unsigned second = (count > 1) ? seq[1] : 0;
+
+    TRACE_EVENT((evSEQUENCE, first, second, count));
+
+    if (first == ESC) {
+	switch (second) {
+	case SS2_7:
+	case SS3_7:
+	    first = SS2;
+	    break;
+	case LS2_7:
+	case LS3_7:
+	case LS1R_7:
+	case LS2R_7:
+	case LS3R_7:
+	    first = LS0;
+	    break;
+	case CSI_7:
+	    first = CSI;
+	    break;
+	}
+    }
+    switch (first) {
+    case SS2:
+    case SS3:
+	is->stats.seq_ss++;
+	break;
+    case LS0:
+    case LS1:
+	is->stats.seq_ls++;
+	break;
+    case CSI:
+	is->stats.seq_csi++;
+	break;
+    case ESC:
+	if (second >= 0x24 && second <= 0x2F)
+	    is->stats.seq_select++;
+	else
+	    is->stats.seq_other++;
+	break;
+    default:
+	is->stats.seq_other++;
+	break;
+    }
+}
+
+/*
+ * If the sequence introduces a control string, set the parser state for it.
+ */
+static int
+beginString(Iso2022Ptr is, const unsigned char *seq, unsigned count)
+{
+    unsigned code = seq[0];
+
+    if (code == ESC && count == 2)
+	code = (unsigned) seq[1] + 0x40;
+
+    switch (code) {
+    case DCS:
+    case SOS:
+    case PM:
+    case APC:
+	is->string_osc = 0;
+	is->parserState = P_STRING;
+	break;
+    case OSC:
+	is->string_osc = 1;
+	is->string_param = 0;
+	is->parserState = P_OSC;
+	break;
+    default:
+	return 0;
+    }
+    is->stats.seq_string++;
+    return 1;
+}
+
+static void
+terminate(Iso2022Ptr is, int fd, const unsigned char *seq, unsigned count)
+{
+    countSequence(is, seq, count);
+    if (beginString(is, seq, count)) {
+	if (count == 1)
+	    outbufCode(is, fd, seq[0]);		/* 8-bit introducer */
+	else
+	    outbuf_sequence(is, fd, seq, count);
+	return;
+    }
     if (is->outputFlags & OF_PASSTHRU) {
-	outbuf_buffered(is, fd);
+	outbuf_sequence(is, fd, seq, count);
 	return;
     }
 
-    switch (is->buffered[0]) {
+    switch (seq[0]) {
     case SS2:
 	if (is->outputFlags & OF_SS)
 	    is->shiftState = S_SS2;
-	discard_buffered(is);
 	return;
     case SS3:
 	if (is->outputFlags & OF_SS)
 	    is->shiftState = S_SS3;
-	discard_buffered(is);
 	return;
     case LS0:
 	if (is->outputFlags & OF_LS)
 	    is->glp = &G0(is);
-	discard_buffered(is);
 	return;
     case LS1:
 	if (is->outputFlags & OF_LS)
 	    is->glp = &G1(is);
-	discard_buffered(is);
 	return;
     case ESC:
-	assert(is->buffered_count >= 2);
-	switch (is->buffered[1]) {
+	assert(count >= 2);
+	switch (seq[1]) {
 	case SS2_7:
 	    if (is->outputFlags & OF_SS)
 		is->shiftState = S_SS2;
-	    discard_buffered(is);
 	    return;
 	case SS3_7:
 	    if (is->outputFlags & OF_SS)
 		is->shiftState = S_SS3;
-	    discard_buffered(is);
 	    return;
 	case LS2_7:
 	    if (is->outputFlags & OF_SS)
 		is->glp = &G2(is);
-	    discard_buffered(is);
 	    return;
 	case LS3_7:
 	    if (is->outputFlags & OF_LS)
 		is->glp = &G3(is);
-	    discard_buffered(is);
 	    return;
 	case LS1R_7:
 	    if (is->outputFlags & OF_LS)
 		is->grp = &G1(is);
-	    discard_buffered(is);
 	    return;
 	case LS2R_7:
 	    if (is->outputFlags & OF_LS)
 		is->grp = &G2(is);
-	    discard_buffered(is);
 	    return;
 	case LS3R_7:
 	    if (is->outputFlags & OF_LS)
 		is->grp = &G3(is);
-	    discard_buffered(is);
 	    return;
 	default:
-	    terminateEsc(is, fd,
-			 is->buffered + 1,
-			 (unsigned) (is->buffered_count - 1));
+	    terminateEsc(is, fd, seq, count);
 	    break;
 	}
 	return;
     default:
-	outbuf_buffered(is, fd);
+	outbuf_sequence(is, fd, seq, count);
     }
 }
 
 static void
-terminateEsc(Iso2022Ptr is, int fd, unsigned char *s_start, unsigned count)
+terminateEsc(Iso2022Ptr is, int fd, const unsigned char *seq, unsigned length)
 {
     const CharsetRec *charset;
+    const unsigned char *s_start = seq + 1;
+    unsigned count = length - 1;
 
     /* ISO 2022 doesn't allow 2C, but Emacs/MULE uses it in 7-bit
        mode */
@@ -1107,13 +2313,11 @@ terminateEsc(Iso2022Ptr is, int fd, unsigned char *s_start, unsigned count)
 		break;
 	    }
 	}
-	discard_buffered(is);
     } else if (s_start[0] == 0x24 && count == 2) {
 	if (is->outputFlags & OF_SELECT) {
 	    charset = getCharset(s_start[1], T_9494);
 	    G0(is) = charset;
 	}
-	discard_buffered(is);
     } else if (s_start[0] == 0x24 && count >= 2 &&
 	       (s_start[1] == 0x28 || s_start[1] == 0x29 ||
 		s_start[1] == 0x2A || s_start[1] == 0x2B ||
@@ -1143,9 +2347,9 @@ terminateEsc(Iso2022Ptr is, int fd, unsigned char *s_start, unsigned count)
 		break;
 	    }
 	}
-	discard_buffered(is);
-    } else
-	outbuf_buffered(is, fd);
+    } else {
+	outbuf_sequence(is, fd, seq, length);
+    }
 }
 
 #ifdef NO_LEAKS
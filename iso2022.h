@@ -29,6 +29,7 @@ THE SOFTWARE.
 #include <charset.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
 
 #define ESC    0x1B
 #define CSI    0x9B
@@ -44,6 +45,20 @@ THE SOFTWARE.
 #define LS1R_7 0x7E
 #define LS2R_7 0x7D
 #define LS3R_7 0x7C
+#define BEL    0x07
+#define CAN    0x18
+#define SUB    0x1A
+#define DCS    0x90
+#define DCS_7  'P'
+#define SOS    0x98
+#define SOS_7  'X'
+#define ST     0x9C
+#define OSC    0x9D
+#define OSC_7  ']'
+#define PM     0x9E
+#define PM_7   '^'
+#define APC    0x9F
+#define APC_7  '_'
 
 #define IS_FINAL_ESC(x) (((x) & 0xF0 ) != 0x20)
 #define IS_FINAL_CSI(x) (((x) & 0xF0 ) != 0x20 && (((x) & 0xF0 ) != 0x30))
@@ -51,6 +66,8 @@ THE SOFTWARE.
 #define P_NORMAL    0
 #define P_ESC       1
 #define P_CSI       2
+#define P_STRING    3		/* DCS, OSC, etc., passed through unchanged */
+#define P_OSC       4		/* the numeric parameter of an OSC */
 
 #define S_NORMAL    0
 #define S_SS2       1
@@ -66,6 +83,75 @@ THE SOFTWARE.
 #define OF_SELECT   4
 #define OF_PASSTHRU 8
 
+/* the encodings which copyOut can write, for converter mode */
+#define OE_UTF8     0
+#define OE_OTHER    1		/* uses the reverse mappings of "target" */
+#define OE_UTF16LE  2
+#define OE_UTF16BE  3
+#define OE_UTF32LE  4
+#define OE_UTF32BE  5
+
+#define OE_WIDE(is) ((is)->outputEncoding >= OE_UTF16LE)
+
+/*
+ * copyIn() caches the byte-sequence written for each Unicode value, including
+ * any shift prefix.  The cache is compiled a page at a time, and discarded if
+ * the charsets or input flags change.  A zero length marks a code which cannot
+ * be mapped.
+ */
+#define INPUT_PAGE_SIZE 0x100
+#define INPUT_PAGES     (0x110000 / INPUT_PAGE_SIZE)
+
+typedef struct {
+    unsigned char length;
+    unsigned char text[4];
+} InputCodeRec, *InputCodePtr;
+
+typedef struct {
+    const CharsetRec *g[4];
+    const CharsetRec *other;
+    const CharsetRec **glp;
+    const CharsetRec **grp;
+    int inputFlags;
+} InputKeyRec;
+
+/*
+ * Counters which can be reported with the -stats option.  These are cheap
+ * enough to leave enabled: the byte-counts are updated per chunk, and the
+ * per-charset counts are accumulated for the most recently used charset.
+ */
+#define MAX_STATS_CHARSETS 16
+
+typedef struct {
+    const CharsetRec *charset;	/* null for the overflow slot */
+    unsigned long count;
+} StatsCharsetRec;
+
+typedef struct {
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long dropped;	/* null or unmapped codepoints */
+    unsigned long seq_ss;	/* single shifts */
+    unsigned long seq_ls;	/* locking shifts */
+    unsigned long seq_csi;	/* control sequences */
+    unsigned long seq_select;	/* charset designations */
+    unsigned long seq_other;	/* other escape sequences */
+    unsigned long seq_spans;	/* sequences found within one read */
+    unsigned long seq_buffered;	/* sequences split across reads */
+    unsigned long seq_string;	/* control strings, e.g., DCS or OSC */
+    unsigned long string_bytes;	/* bytes passed through in strings */
+    unsigned long pastes;	/* bracketed pastes from the terminal */
+    unsigned long paste_bytes;	/* bytes in those pastes */
+    unsigned long flushes;	/* calls to outbuf_flush */
+    unsigned long short_writes;
+    unsigned long waits;	/* EAGAIN waits for output */
+    double blocked;		/* seconds spent waiting for output */
+    double started;		/* time when the counters were started */
+    const CharsetRec *last_charset;
+    unsigned long last_count;
+    StatsCharsetRec decoded[MAX_STATS_CHARSETS];
+} Iso2022Stats;
+
 typedef struct _Iso2022 {
     const CharsetRec **glp;
     const CharsetRec **grp;
@@ -75,12 +161,32 @@ typedef struct _Iso2022 {
     int shiftState;
     int inputFlags;
     int outputFlags;
+    int outputEncoding;		/* OE_UTF8, etc. */
+    struct _Iso2022 *target;	/* charsets for OE_OTHER */
     unsigned char *buffered;
     size_t buffered_len;
     size_t buffered_count;
     int buffered_ku;
+    int string_osc;		/* nonzero if the string is an OSC */
+    unsigned string_param;	/* the OSC's numeric parameter */
+    unsigned csi_param;		/* last numeric parameter of an input CSI */
+    unsigned long seq_start;	/* value of bytes_in where it began */
+    int pasting;		/* inside a bracketed paste */
+    unsigned long paste_start;	/* value of bytes_in at its beginning */
+    double paste_time;		/* seconds spent converting it */
     unsigned char *outbuf;
     size_t outbuf_count;
+    InputCodePtr *input_map;
+    InputKeyRec input_key;
+    Iso2022Stats stats;
+    unsigned flush_delay;	/* milliseconds to hold output, 0 for none */
+    unsigned flush_bytes;	/* write held output when this much is ready */
+    int flush_now;		/* a keystroke was sent; do not hold its echo */
+    struct timeval flush_due;	/* when held output must be written */
+    unsigned char *queue;	/* output not yet written */
+    size_t queue_head;
+    size_t queue_count;
+    int write_error;		/* errno of the first failed write, if any */
 } Iso2022Rec, *Iso2022Ptr;
 
 #define GL(i) (*(i)->glp)
@@ -92,13 +198,32 @@ typedef struct _Iso2022 {
 #define OTHER(i) ((i)->other)
 
 #define BUFFER_SIZE 512
+#define OUTBUF_SIZE (8 * BUFFER_SIZE)
+
+/*
+ * Output which the terminal (or pty) will not accept yet is queued, and
+ * written as the event loop finds the file descriptor writable.  Reading from
+ * the other side stops while the queue has less than QUEUE_RESERVE bytes free,
+ * which is enough for the output from one chunk.
+ */
+#define QUEUE_SIZE (16 * OUTBUF_SIZE)
+#define QUEUE_RESERVE (2 * OUTBUF_SIZE)
 
 Iso2022Ptr allocIso2022(void);
 int initIso2022(const char *, const char *, Iso2022Ptr);
+int setOutputEncoding(Iso2022Ptr, const char *);
 int mergeIso2022(Iso2022Ptr, Iso2022Ptr);
 void reportIso2022(const char *, Iso2022Ptr);
+void reportStats(FILE *, const char *, Iso2022Ptr);
 void copyIn(Iso2022Ptr, int, unsigned char *, int);
 void copyOut(Iso2022Ptr, int, unsigned char *, unsigned);
+int pendingIso2022(Iso2022Ptr);
+void flushIso2022(Iso2022Ptr, int);
+int drainIso2022(Iso2022Ptr, int);
+void finishIso2022(Iso2022Ptr, int);
+
+#define queuedIso2022(is) ((is)->queue_count != 0)
+#define fullIso2022(is) ((is)->queue_count + QUEUE_RESERVE > QUEUE_SIZE)
 
 #ifdef NO_LEAKS
 void destroyIso2022(Iso2022Ptr);
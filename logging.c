@@ -0,0 +1,374 @@
+/*
+Copyright 2026 by the luit contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+ */
+
+#include <luit.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <sys.h>
+#include <trace.h>
+#include <logging.h>
+
+static LogPtr all_logs;		/* logs whose writer has been started */
+
+static size_t
+readFully(int fd, void *buffer, size_t length)
+{
+    size_t result = 0;
+
+    while (result < length) {
+	ssize_t rc = read(fd, (char *) buffer + result, length - result);
+	if (rc > 0) {
+	    result += (size_t) rc;
+	} else if (rc < 0 && errno == EINTR) {
+	    continue;
+	} else {
+	    break;
+	}
+    }
+    return result;
+}
+
+static int
+writeFully(int fd, const void *buffer, size_t length)
+{
+    size_t done = 0;
+
+    while (done < length) {
+	ssize_t rc = write(fd, (const char *) buffer + done, length - done);
+	if (rc > 0) {
+	    done += (size_t) rc;
+	} else if (rc < 0 && errno == EINTR) {
+	    continue;
+	} else {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+#ifdef USE_ZLIB
+static int
+isCompressed(const char *name)
+{
+    size_t len = strlen(name);
+    return (len > 3 && !strcmp(name + len - 3, ".gz"));
+}
+#endif
+
+/*
+ * This runs in the writer process: read frames from the pipe until luit
+ * closes it, writing the data to the log file, and the delay since the
+ * previous frame to the timing file in the format used by scriptreplay.
+ */
+static void
+runWriter(LogPtr log, int input)
+{
+    LogFrame frame;
+    unsigned char *data = NULL;
+    size_t size = 0;
+    LogFrame last;
+    int first = 1;
+#ifdef USE_ZLIB
+    gzFile gz = NULL;
+#endif
+
+    installHandler(SIGHUP, SIG_IGN);
+    installHandler(SIGINT, SIG_IGN);
+    installHandler(SIGQUIT, SIG_IGN);
+
+    if (droppriv() < 0)
+	_exit(EXIT_FAILURE);
+
+#ifdef USE_ZLIB
+    if (isCompressed(log->name)) {
+	if ((gz = gzdopen(log->fd, "wb")) == NULL)
+	    _exit(EXIT_FAILURE);
+    }
+#endif
+
+    memset(&last, 0, sizeof(last));
+    while (readFully(input, &frame, sizeof(frame)) == sizeof(frame)) {
+	if (frame.length > size) {
+	    unsigned char *resized = realloc(data, (size_t) frame.length);
+	    if (resized == NULL)
+		break;
+	    data = resized;
+	    size = frame.length;
+	}
+	if (readFully(input, data, (size_t) frame.length) != frame.length)
+	    break;
+#ifdef USE_ZLIB
+	if (gz != NULL)
+	    IGNORE_RC(gzwrite(gz, data, frame.length));
+	else
+#endif
+	    IGNORE_RC(writeFully(log->fd, data, (size_t) frame.length));
+
+	if (log->timing >= 0) {
+	    char line[80];
+	    double delay = 0.0;
+
+	    if (!first) {
+		delay = ((double) frame.sec - (double) last.sec
+			 + ((double) frame.usec - (double) last.usec) / 1e6);
+	    }
+	    sprintf(line, "%.6f %u\n", delay, frame.length);
+	    IGNORE_RC(writeFully(log->timing, line, strlen(line)));
+	    last = frame;
+	    first = 0;
+	}
+    }
+
+#ifdef USE_ZLIB
+    if (gz != NULL)
+	gzclose(gz);
+    else
+#endif
+	close(log->fd);
+    if (log->timing >= 0)
+	close(log->timing);
+    _exit(EXIT_SUCCESS);
+}
+
+LogPtr
+openLog(const char *name)
+{
+    LogPtr log = TypeCalloc(LogRec);
+
+    if (log != NULL) {
+	log->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+	if (log->fd < 0) {
+	    int save = errno;
+	    free(log);
+	    errno = save;
+	    return NULL;
+	}
+	log->name = strmalloc(name);
+	log->timing = -1;
+	log->pipe = -1;
+	log->writer = -1;
+    }
+    return log;
+}
+
+/*
+ * Fork the writer process, leaving luit with the write-end of a non-blocking
+ * pipe to it.
+ */
+int
+startLog(LogPtr log)
+{
+    int fds[2];
+    int val;
+
+    TRACE(("startLog(%s)\n", NonNull(log->name)));
+    if (log_timing) {
+	char *name = malloc(strlen(log->name) + sizeof(".timing"));
+	if (name == NULL)
+	    return -1;
+	sprintf(name, "%s.timing", log->name);
+	log->timing = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+	free(name);
+	if (log->timing < 0)
+	    return -1;
+    }
+
+    if ((log->buffer = malloc((size_t) LOG_BUFFER)) == NULL)
+	return -1;
+
+    if (pipe(fds) < 0)
+	return -1;
+
+    log->writer = fork();
+    if (log->writer < 0) {
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+    } else if (log->writer == 0) {
+	LogPtr p;
+	close(fds[1]);
+	for (p = all_logs; p != NULL; p = p->next)
+	    close(p->pipe);
+	runWriter(log, fds[0]);
+    }
+
+    close(fds[0]);
+    close(log->fd);
+    log->fd = -1;
+    if (log->timing >= 0) {
+	close(log->timing);
+	log->timing = -1;
+    }
+
+    log->pipe = fds[1];
+    val = fcntl(log->pipe, F_GETFL, 0);
+    if (val >= 0)
+	(void) fcntl(log->pipe, F_SETFL, val | O_NONBLOCK);
+    (void) fcntl(log->pipe, F_SETFD, FD_CLOEXEC);
+
+    log->next = all_logs;
+    all_logs = log;
+    return 0;
+}
+
+/*
+ * Write as much of the buffer to the pipe as it will take, or (if asked to
+ * wait) all of it.  SIGPIPE is blocked only while writing to the pipe, so that
+ * a writer which has died shows up as EPIPE, while a closed stdout still stops
+ * luit as usual.
+ */
+static void
+drainLog(LogPtr log, int wait)
+{
+    sigset_t pipemask;
+    sigset_t oldmask;
+
+    sigemptyset(&pipemask);
+    sigaddset(&pipemask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipemask, &oldmask);
+
+    while (log->head < log->used) {
+	ssize_t rc = write(log->pipe,
+			   log->buffer + log->head,
+			   log->used - log->head);
+	if (rc > 0) {
+	    log->head += (size_t) rc;
+	} else if (rc < 0 && errno == EINTR) {
+	    continue;
+	} else if (rc == 0 || errno == EAGAIN) {
+	    if (!wait || waitForOutput(log->pipe) == IO_Closed)
+		break;
+	} else {
+	    TRACE_ERR("drainLog - writer is gone");
+	    if (errno == EPIPE && !sigismember(&oldmask, SIGPIPE)) {
+		sigset_t pending;
+		int sig;
+
+		/* discard the SIGPIPE raised by this write */
+		if (sigpending(&pending) == 0
+		    && sigismember(&pending, SIGPIPE))
+		    (void) sigwait(&pipemask, &sig);
+	    }
+	    log->dropped += (unsigned long) (log->used - log->head);
+	    close(log->pipe);
+	    log->pipe = -1;
+	    log->head = log->used = 0;
+	    break;
+	}
+    }
+    if (log->head == log->used)
+	log->head = log->used = 0;
+
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+static int
+roomInLog(LogPtr log, size_t need)
+{
+    if (log->used + need > LOG_BUFFER && log->head != 0) {
+	memmove(log->buffer, log->buffer + log->head, log->used - log->head);
+	log->used -= log->head;
+	log->head = 0;
+    }
+    return (log->used + need <= LOG_BUFFER);
+}
+
+void
+writeLog(LogPtr log, const void *data, size_t length)
+{
+    LogFrame frame;
+    struct timeval now;
+    size_t need = sizeof(frame) + length;
+
+    if (log == NULL || length == 0)
+	return;
+
+    if (log->pipe < 0 || !roomInLog(log, need)) {
+	if (log->pipe >= 0)
+	    drainLog(log, !log_drop);
+	if (log->pipe < 0 || !roomInLog(log, need)) {
+	    log->dropped += (unsigned long) length;
+	    return;
+	}
+    }
+
+    gettimeofday(&now, NULL);
+    frame.sec = (unsigned) now.tv_sec;
+    frame.usec = (unsigned) now.tv_usec;
+    frame.length = (unsigned) length;
+
+    memcpy(log->buffer + log->used, &frame, sizeof(frame));
+    log->used += sizeof(frame);
+    memcpy(log->buffer + log->used, data, length);
+    log->used += length;
+
+    drainLog(log, 0);
+}
+
+/*
+ * Flush the buffer, and wait for the writer to finish.
+ */
+void
+closeLog(LogPtr log)
+{
+    LogPtr *p;
+
+    if (log == NULL)
+	return;
+
+    TRACE(("closeLog(%s)\n", NonNull(log->name)));
+    if (log->pipe >= 0) {
+	drainLog(log, 1);
+	close(log->pipe);
+    }
+    for (p = &all_logs; *p != NULL; p = &((*p)->next)) {
+	if (*p == log) {
+	    *p = log->next;
+	    break;
+	}
+    }
+    if (log->writer > 0) {
+	while (waitpid(log->writer, NULL, 0) < 0 && errno == EINTR) {
+	    ;
+	}
+    }
+    if (log->fd >= 0)
+	close(log->fd);
+    if (log->timing >= 0)
+	close(log->timing);
+    if (log->dropped != 0)
+	Warning("discarded %lu bytes of log %s\n", log->dropped, log->name);
+
+    free(log->buffer);
+    free(log->name);
+    free(log);
+}
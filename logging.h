@@ -0,0 +1,68 @@
+/*
+Copyright 2026 by the luit contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+ */
+
+#ifndef LUIT_LOGGING_H
+#define LUIT_LOGGING_H 1
+
+#include <luit.h>		/* include this, for self-contained headers */
+
+#include <sys/types.h>
+
+/*
+ * The -ilog and -olog files are written by a separate process, so that a
+ * slow disk does not stall the terminal.  Each chunk is sent to the writer
+ * through a pipe as a LogFrame followed by the data.  If the pipe is full,
+ * chunks are kept in the buffer, and when that fills, luit either waits for
+ * the writer or (with -log-drop) discards the chunk.
+ */
+#define LOG_BUFFER (256 * 1024)
+
+typedef struct {
+    unsigned sec;
+    unsigned usec;
+    unsigned length;		/* bytes of data following the frame */
+} LogFrame;
+
+typedef struct _LogRec {
+    char *name;
+    int fd;			/* the log file, until the writer starts */
+    int timing;			/* the timing file, until the writer starts */
+    int pipe;			/* write-end of the pipe to the writer */
+    pid_t writer;
+    unsigned char *buffer;	/* frames not yet written to the pipe */
+    size_t head;
+    size_t used;
+    unsigned long dropped;	/* bytes discarded, reported on closing */
+    struct _LogRec *next;
+} LogRec, *LogPtr;
+
+extern LogPtr ilog;
+extern LogPtr olog;
+extern int log_drop;
+extern int log_timing;
+
+LogPtr openLog(const char *name);
+int startLog(LogPtr log);
+void writeLog(LogPtr log, const void *data, size_t length);
+void closeLog(LogPtr log);
+
+#endif /* LUIT_LOGGING_H */
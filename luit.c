@@ -30,12 +30,16 @@ THE SOFTWARE.
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <signal.h>
+#include <time.h>
 
 #include <version.h>
 #include <sys.h>
 #include <parser.h>
 #include <iso2022.h>
+#include <logging.h>
 
 static int pipe_option = 0;
 static int p2c_waitpipe[2];
@@ -47,13 +51,19 @@ static char *child_argv0 = NULL;
 static const char *locale_name = NULL;
 static int exitOnChild = 0;
 static int converter = 0;
+static const char *output_dir = NULL;
+static int batch_jobs = 0;
+static int keep_times = 0;
+static const char *output_encoding = NULL;
 static int testonly = 0;
 static int warnings = 0;
 
 const char *locale_alias = LOCALE_ALIAS_FILE;
 
-int ilog = -1;
-int olog = -1;
+LogPtr ilog = NULL;
+LogPtr olog = NULL;
+int log_drop = 0;
+int log_timing = 0;
 int verbose = 0;
 int ignore_locale = 0;
 int fill_fontenc = 0;
@@ -63,13 +73,40 @@ UM_MODE lookup_order[] =
 {
     umFONTENC, umBUILTIN, umICONV, umPOSIX, umNONE
 };
+
+const char *share_dir = NULL;
 #endif
 
+static FILE *stats_fp = NULL;
+static unsigned flush_delay = 0;
+static unsigned flush_bytes = 0;
+
 static volatile int sigwinch_queued = 0;
 static volatile int sigchld_queued = 0;
+static volatile int sigusr1_queued = 0;
+
+#if defined(OPT_TRACE) && defined(SIGUSR2)
+#define TRACE_SIGNAL 1
+static volatile int sigusr2_queued = 0;
+#define checkTraceSignal() \
+	if (sigusr2_queued) { \
+	    sigusr2_queued = 0; \
+	    TraceFlush(); \
+	}
+#else
+#define checkTraceSignal()	/* nothing */
+#endif
 
 static int convert(int, int);
+static int convertFiles(int, char **);
 static int condom(int, char **);
+static void reportStatistics(void);
+#ifdef SIGUSR1
+static void sigusr1Handler(int);
+#endif
+#ifdef TRACE_SIGNAL
+static void sigusr2Handler(int);
+#endif
 static void child(int sfd, char *, char *, char *const *);
 
 void
@@ -118,6 +155,8 @@ help(const char *program, int fatal)
 	DATA("c", -, "simple converter stdin/stdout"),
 	DATA("encoding encoding", -, "use this encoding rather than current locale's encoding"),
 	DATA("fill-fontenc", -, "fill in one-one mapping in -show-fontenc report"),
+	DATA("flush-bytes count", -, "write held output when this much is ready"),
+	DATA("flush-delay msecs", -, "hold output for up to this many milliseconds"),
 	DATA("g0 set", -, "set output G0 charset (default ASCII)"),
 	DATA("g1 set", -, "set output G1 charset"),
 	DATA("g2 set", -, "set output G2 charset"),
@@ -126,7 +165,9 @@ help(const char *program, int fatal)
 	DATA("gr gk", -, "set output GR charset"),
 	DATA("h", -, "show this message"),
 	DATA("ilog filename", -, "log all input to this file"),
+	DATA("jobs count", -, "convert this many files at a time with -o"),
 	DATA("k7", -, "generate 7-bit characters for input"),
+	DATA("keep-times", -, "give files converted with -o the same times"),
 	DATA("kg0 set", -, "set input G0 charset"),
 	DATA("kg1 set", -, "set input G1 charset"),
 	DATA("kg2 set", -, "set input G2 charset"),
@@ -140,6 +181,9 @@ help(const char *program, int fatal)
 	DATA("list-builtin", -, "list built-in encodings"),
 	DATA("list-fontenc", -, "list available \".enc\" encoding files"),
 	DATA("list-iconv", -, "list iconv-supported encodings"),
+	DATA("log-drop", -, "discard log data rather than wait for the disk"),
+	DATA("log-timing", -, "write a \".timing\" file for each log"),
+	DATA("o dir", -, "with -c, convert files given as arguments into dir"),
 	DATA("olog filename", -, "log all output to this file"),
 	DATA("ols", +, "disable locking-shifts in output"),
 	DATA("osl", +, "disable charset-selection sequences in output"),
@@ -147,10 +191,13 @@ help(const char *program, int fatal)
 	DATA("ot", +, "disable interpretation of all sequences in output"),
 	DATA("p", -, "do parent/child handshake"),
 	DATA("prefer list", -, "override preference between fontenc/iconv lookups"),
+	DATA("share-dir dir", -, "share tables built with iconv in this directory"),
 	DATA("show-builtin enc", -, "show details of a given built-in encoding"),
 	DATA("show-fontenc enc", -, "show details of an \".enc\" encoding file"),
 	DATA("show-iconv enc", -, "show iconv encoding in \".enc\" format"),
+	DATA("stats filename", -, "write statistics on SIGUSR1 and at exit"),
 	DATA("t", -, "testing (initialize locale but no terminal)"),
+	DATA("to encoding", -, "with -c, write this encoding rather than UTF-8"),
 	DATA("v", -, "verbose (repeat to increase level)"),
 	DATA("x", -, "exit as soon as child dies"),
 	DATA("-", -, "end of options"),
@@ -333,6 +380,9 @@ parseOptions(int argc, char **argv)
 	} else if (!strcmp(argv[i], "-prefer")) {
 	    setLookupOrder(getParam(i));
 	    i += 2;
+	} else if (!strcmp(argv[i], "-share-dir")) {
+	    share_dir = getParam(i);
+	    i += 2;
 	} else if (!strcmp(argv[i], "-show-builtin")) {
 	    ExitProgram(showBuiltinCharset(getParam(i)));
 	} else if (!strcmp(argv[i], "-show-fontenc")) {
@@ -458,24 +508,61 @@ parseOptions(int argc, char **argv)
 	} else if (!strcmp(argv[i], "-c")) {
 	    converter = 1;
 	    i++;
+	} else if (!strcmp(argv[i], "-o")) {
+	    output_dir = getParam(i);
+	    i += 2;
+	} else if (!strcmp(argv[i], "-to")) {
+	    output_encoding = getParam(i);
+	    i += 2;
+	} else if (!strcmp(argv[i], "-jobs")) {
+	    batch_jobs = atoi(getParam(i));
+	    i += 2;
+	} else if (!strcmp(argv[i], "-keep-times")) {
+	    keep_times = 1;
+	    i++;
+	} else if (!strcmp(argv[i], "-flush-bytes")) {
+	    int value = atoi(getParam(i));
+	    if (value <= 0 || value > OUTBUF_SIZE)
+		value = OUTBUF_SIZE;
+	    flush_bytes = (unsigned) value;
+	    i += 2;
+	} else if (!strcmp(argv[i], "-flush-delay")) {
+	    int value = atoi(getParam(i));
+	    flush_delay = (value > 0) ? (unsigned) value : 0;
+	    i += 2;
+	} else if (!strcmp(argv[i], "-log-drop")) {
+	    log_drop = 1;
+	    i++;
+	} else if (!strcmp(argv[i], "-log-timing")) {
+	    log_timing = 1;
+	    i++;
 	} else if (!strcmp(argv[i], "-ilog")) {
-	    if (ilog >= 0)
-		close(ilog);
-	    ilog = open(getParam(i), O_WRONLY | O_CREAT | O_TRUNC, 0777);
-	    if (ilog < 0) {
+	    closeLog(ilog);
+	    ilog = openLog(getParam(i));
+	    if (ilog == NULL) {
 		perror("Couldn't open input log");
 		ExitFailure();
 	    }
 	    i += 2;
 	} else if (!strcmp(argv[i], "-olog")) {
-	    if (olog >= 0)
-		close(olog);
-	    olog = open(getParam(i), O_WRONLY | O_CREAT | O_TRUNC, 0777);
-	    if (olog < 0) {
+	    closeLog(olog);
+	    olog = openLog(getParam(i));
+	    if (olog == NULL) {
 		perror("Couldn't open output log");
 		ExitFailure();
 	    }
 	    i += 2;
+	} else if (!strcmp(argv[i], "-stats")) {
+	    const char *name = getParam(i);
+	    if (stats_fp != NULL && stats_fp != stderr)
+		fclose(stats_fp);
+	    if (!strcmp(name, "-")) {
+		stats_fp = stderr;
+	    } else if ((stats_fp = fopen(name, "w")) == NULL) {
+		perror("Couldn't open statistics file");
+		ExitFailure();
+	    }
+	    i += 2;
 	} else if (!strcmp(argv[i], "-alias")) {
 	    locale_alias = getParam(i);
 	    i += 2;
@@ -618,11 +705,21 @@ main(int argc, char **argv)
     i = parseOptions(argc, argv);
     if (i < 0)
 	FatalError("Couldn't parse options\n");
+    if (output_dir != NULL && !converter)
+	FatalError("The -o option is used only with -c\n");
+    if (output_dir != NULL && (ilog != NULL || olog != NULL || stats_fp != NULL))
+	FatalError("The -o option cannot be used with -ilog, -olog or -stats\n");
+    if (output_encoding != NULL && !converter)
+	FatalError("The -to option is used only with -c\n");
 
     rc = initIso2022(locale_name, NULL, outputState);
     if (rc < 0)
 	FatalError("Couldn't init output state\n");
 
+    if (output_encoding != NULL
+	&& setOutputEncoding(outputState, output_encoding) < 0)
+	FatalError("Couldn't find output encoding %s\n", output_encoding);
+
     rc = mergeIso2022(inputState, outputState);
     if (verbose) {
 	reportIso2022("Input", inputState);
@@ -635,10 +732,32 @@ main(int argc, char **argv)
 	    rc += warnings;
 	}
     } else {
-	if (converter)
+	if (ilog != NULL && startLog(ilog) < 0) {
+	    perror("Couldn't start input log");
+	    ExitFailure();
+	}
+	if (olog != NULL && startLog(olog) < 0) {
+	    perror("Couldn't start output log");
+	    ExitFailure();
+	}
+#ifdef SIGUSR1
+	if (stats_fp != NULL)
+	    installHandler(SIGUSR1, sigusr1Handler);
+#endif
+#ifdef TRACE_SIGNAL
+	installHandler(SIGUSR2, sigusr2Handler);
+#endif
+	if (converter && output_dir != NULL)
+	    rc = convertFiles(argc - i, argv + i);
+	else if (converter)
 	    rc = convert(STDIN_FILENO, STDOUT_FILENO);
 	else
 	    rc = condom(argc - i, argv + i);
+	if (stats_fp != NULL)
+	    reportStatistics();
+	closeLog(ilog);
+	closeLog(olog);
+	ilog = olog = NULL;
     }
 
 #ifdef NO_LEAKS
@@ -647,6 +766,21 @@ main(int argc, char **argv)
     return rc;
 }
 
+/*
+ * Write one line of JSON with the counters for both directions.
+ */
+static void
+reportStatistics(void)
+{
+    fprintf(stats_fp, "{\"pid\": %ld, \"time\": %ld, ",
+	    (long) getpid(), (long) time((time_t *) 0));
+    reportStats(stats_fp, "output", outputState);
+    fprintf(stats_fp, ", ");
+    reportStats(stats_fp, "input", inputState);
+    fprintf(stats_fp, "}\n");
+    fflush(stats_fp);
+}
+
 static int
 convert(int ifd, int ofd)
 {
@@ -661,7 +795,14 @@ convert(int ifd, int ofd)
 
     while (1) {
 	i = (int) read(ifd, buf, (size_t) BUFFER_SIZE);
+	if (sigusr1_queued) {
+	    sigusr1_queued = 0;
+	    reportStatistics();
+	}
+	checkTraceSignal();
 	if (i <= 0) {
+	    if (i < 0 && errno == EINTR)
+		continue;
 	    if (i < 0) {
 		perror("Read error");
 		ExitFailure();
@@ -670,9 +811,298 @@ convert(int ifd, int ofd)
 	}
 	copyOut(outputState, ofd, buf, (unsigned) i);
     }
+    finishIso2022(outputState, ofd);
+    if (outputState->write_error != 0) {
+	errno = outputState->write_error;
+	perror("Write error");
+	ExitFailure();
+    }
     return 0;
 }
 
+/*
+ * Batch conversion: convert each of the named files into output_dir, keeping
+ * its relative pathname.  The tables are loaded once, and each file is
+ * converted in a child process, so that it starts with the same state as the
+ * others (including the shift-state of non-ISO-2022 encodings).  Up to
+ * batch_jobs files are converted at a time.
+ */
+typedef struct {
+    pid_t pid;
+    char *name;
+} BatchJob;
+
+/*
+ * Return the next file to convert, from the command-line or standard input,
+ * or null when there are no more.
+ */
+static char *
+nextBatchFile(int argc, char **argv, int *indexp)
+{
+    char *result = NULL;
+
+    if (argc > 0) {
+	if (*indexp < argc)
+	    result = strmalloc(argv[(*indexp)++]);
+    } else {
+	char buffer[BUFSIZ];
+
+	while (result == NULL && fgets(buffer, (int) sizeof(buffer), stdin)) {
+	    char *s = buffer + strlen(buffer);
+
+	    while (s != buffer && isspace(UChar(s[-1])))
+		*--s = '\0';
+	    if (*buffer != '\0')
+		result = strmalloc(buffer);
+	}
+    }
+    return result;
+}
+
+/*
+ * The output file has the same name as the input, relative to output_dir.
+ * Refuse names which would be outside that directory.
+ */
+static char *
+batchOutputName(const char *name)
+{
+    char *result = NULL;
+    const char *s;
+    int outside = 0;
+
+    while (*name == '/')
+	++name;
+    while (!strncmp(name, "./", (size_t) 2))
+	name += 2;
+    for (s = name; s != NULL; s = strchr(s, '/')) {
+	if (*s == '/')
+	    ++s;
+	if (!strncmp(s, "..", (size_t) 2) && (s[2] == '/' || s[2] == '\0'))
+	    outside = 1;
+    }
+    if (!outside
+	&& *name != '\0'
+	&& (result = malloc(strlen(output_dir) + strlen(name) + 2)) != NULL) {
+	sprintf(result, "%s/%s", output_dir, name);
+    }
+    return result;
+}
+
+/*
+ * Make the directories leading to the given file.
+ */
+static void
+makeParents(char *path)
+{
+    char *s;
+
+    for (s = path + strlen(output_dir) + 1; (s = strchr(s, '/')) != NULL; ++s) {
+	*s = '\0';
+	if (mkdir(path, 0777) != 0 && errno != EEXIST)
+	    perror(path);
+	*s = '/';
+    }
+}
+
+/*
+ * Convert one file, in a child process.
+ */
+static int
+convertOneFile(const char *name)
+{
+    static unsigned char buf[16 * OUTBUF_SIZE];
+    struct stat sb;
+    struct stat ob;
+    char *path;
+    char *temp = NULL;
+    int ifd, ofd;
+    int rc = EXIT_FAILURE;
+
+    if ((path = batchOutputName(name)) == NULL) {
+	Message("%s: not converted, outside the output directory\n", name);
+    } else if ((ifd = open(name, O_RDONLY)) < 0) {
+	perror(name);
+    } else {
+	makeParents(path);
+	if (fstat(ifd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+	    Message("%s: not a regular file\n", name);
+	} else if (stat(path, &ob) == 0
+		   && ob.st_dev == sb.st_dev
+		   && ob.st_ino == sb.st_ino) {
+	    Message("%s: not converted, the output would replace it\n", name);
+	} else if ((temp = malloc(strlen(path) + 30)) == NULL) {
+	    perror(path);
+	} else {
+	    /* write a temporary file, renamed into place when complete */
+	    sprintf(temp, "%s.luit-%ld", path, (long) getpid());
+	    if ((ofd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0) {
+		perror(temp);
+	    } else {
+		ssize_t got;
+
+		while ((got = read(ifd, buf, sizeof(buf))) != 0) {
+		    if (got < 0) {
+			if (errno == EINTR)
+			    continue;
+			perror(name);
+			break;
+		    }
+		    copyOut(outputState, ofd, buf, (unsigned) got);
+		}
+		finishIso2022(outputState, ofd);
+		if (outputState->write_error != 0) {
+		    errno = outputState->write_error;
+		    perror(temp);
+		    close(ofd);
+		} else if (close(ofd) != 0) {
+		    perror(temp);
+		} else if (got == 0) {
+		    rc = EXIT_SUCCESS;
+		}
+		if (rc == EXIT_SUCCESS && keep_times) {
+		    struct timeval times[2];
+
+		    times[0].tv_sec = sb.st_atime;
+		    times[0].tv_usec = 0;
+		    times[1].tv_sec = sb.st_mtime;
+		    times[1].tv_usec = 0;
+		    if (utimes(temp, times) != 0)
+			perror(temp);
+		}
+		if (rc == EXIT_SUCCESS && rename(temp, path) != 0) {
+		    perror(path);
+		    rc = EXIT_FAILURE;
+		}
+		if (rc != EXIT_SUCCESS)
+		    unlink(temp);
+	    }
+	    free(temp);
+	}
+	close(ifd);
+    }
+    free(path);
+    return rc;
+}
+
+static double
+batchNow(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + ((double) tv.tv_usec / 1e6);
+}
+
+static int
+convertFiles(int argc, char **argv)
+{
+    BatchJob *jobs;
+    char *name;
+    unsigned long done = 0;
+    unsigned long failed = 0;
+    unsigned long bytes_in = 0;
+    unsigned long bytes_out = 0;
+    double started = batchNow();
+    double elapsed;
+    int index = 0;
+    int running = 0;
+    int more = 1;
+    int n;
+
+    if (droppriv() < 0) {
+	perror("Couldn't drop privileges");
+	ExitFailure();
+    }
+    if (mkdir(output_dir, 0777) != 0 && errno != EEXIST) {
+	perror(output_dir);
+	ExitFailure();
+    }
+    if (batch_jobs <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+	batch_jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (batch_jobs <= 0)
+	    batch_jobs = 1;
+    }
+    if ((jobs = TypeCallocN(BatchJob, batch_jobs)) == NULL)
+	FatalError("Couldn't allocate jobs\n");
+
+    while (more || running != 0) {
+	int status;
+	pid_t pid;
+
+	while (more && running < batch_jobs) {
+	    if ((name = nextBatchFile(argc, argv, &index)) == NULL) {
+		more = 0;
+		break;
+	    }
+	    fflush(stdout);
+	    fflush(stderr);
+	    if ((pid = fork()) < 0) {
+		perror("Couldn't fork");
+		free(name);
+		++failed;
+		if (running == 0)
+		    more = 0;
+		break;
+	    } else if (pid == 0) {
+		_exit(convertOneFile(name));
+	    }
+	    for (n = 0; n < batch_jobs; ++n) {
+		if (jobs[n].pid == 0) {
+		    jobs[n].pid = pid;
+		    jobs[n].name = name;
+		    break;
+		}
+	    }
+	    ++running;
+	}
+	if (running == 0)
+	    break;
+
+	if ((pid = wait(&status)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("wait");
+	    break;
+	}
+	for (n = 0; n < batch_jobs; ++n) {
+	    if (jobs[n].pid == pid) {
+		struct stat sb;
+		char *path;
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+		    ++done;
+		    if (stat(jobs[n].name, &sb) == 0)
+			bytes_in += (unsigned long) sb.st_size;
+		    if ((path = batchOutputName(jobs[n].name)) != NULL) {
+			if (stat(path, &sb) == 0)
+			    bytes_out += (unsigned long) sb.st_size;
+			free(path);
+		    }
+		    VERBOSE(1, ("converted %s\n", jobs[n].name));
+		} else {
+		    ++failed;
+		}
+		free(jobs[n].name);
+		jobs[n].pid = 0;
+		jobs[n].name = NULL;
+		--running;
+		break;
+	    }
+	}
+    }
+
+    elapsed = batchNow() - started;
+    Message("converted %lu files (%lu failed), %lu bytes to %lu bytes"
+	    " in %.3f seconds, %.1f MiB/s\n",
+	    done, failed, bytes_in, bytes_out, elapsed,
+	    (elapsed > 0.0)
+	    ? ((double) bytes_in / elapsed / (1024.0 * 1024.0))
+	    : 0.0);
+    free(jobs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 #ifdef SIGWINCH
 static void
 sigwinchHandler(int sig GCC_UNUSED)
@@ -687,6 +1117,22 @@ sigchldHandler(int sig GCC_UNUSED)
     sigchld_queued = 1;
 }
 
+#ifdef SIGUSR1
+static void
+sigusr1Handler(int sig GCC_UNUSED)
+{
+    sigusr1_queued = 1;
+}
+#endif
+
+#ifdef TRACE_SIGNAL
+static void
+sigusr2Handler(int sig GCC_UNUSED)
+{
+    sigusr2_queued = 1;
+}
+#endif
+
 static int
 setup_io(int sfd, int pty)
 {
@@ -829,19 +1275,47 @@ parent(int sfd, int pty)
     }
     setup_io(sfd, pty);
 
+    outputState->flush_delay = flush_delay;
+    if (flush_bytes != 0)
+	outputState->flush_bytes = flush_bytes;
+
     if (pipe_option) {
 	write_waitpipe(p2c_waitpipe);
 	close_waitpipe(1);
     }
 
     for (;;) {
-	rc = waitForInput(sfd, pty);
+	/*
+	 * Stop reading from either side while the queue for the other side is
+	 * full, and watch for the queues to drain.
+	 */
+	int wanted = 0;
+
+	if (!fullIso2022(inputState))
+	    wanted |= IO_CanRead;
+	if (!fullIso2022(outputState))
+	    wanted |= IO_CanWrite;
+	if (queuedIso2022(outputState))
+	    wanted |= IO_Output1;
+	if (queuedIso2022(inputState))
+	    wanted |= IO_Output2;
+
+	rc = waitForIO(sfd, pty, wanted, pendingIso2022(outputState));
+
+	if (pendingIso2022(outputState) == 0)
+	    flushIso2022(outputState, sfd);
 
 	if (sigwinch_queued) {
 	    sigwinch_queued = 0;
 	    setWindowSize(sfd, pty);
 	}
 
+	if (sigusr1_queued) {
+	    sigusr1_queued = 0;
+	    reportStatistics();
+	}
+	checkTraceSignal();
+
 	if (sigchld_queued && exitOnChild)
 	    break;
 
@@ -849,6 +1323,10 @@ parent(int sfd, int pty)
 	    if (rc & IO_Closed) {
 		break;
 	    }
+	    if ((rc & IO_Output1) && drainIso2022(outputState, sfd) < 0)
+		break;
+	    if ((rc & IO_Output2) && drainIso2022(inputState, pty) < 0)
+		break;
 	    if (rc & IO_CanWrite) {
 		i = (int) read(pty, buf, (size_t) BUFFER_SIZE);
 		if ((i == 0) || ((i < 0) && (errno != EAGAIN)))
@@ -860,11 +1338,16 @@ parent(int sfd, int pty)
 		i = (int) read(sfd, buf, (size_t) BUFFER_SIZE);
 		if ((i == 0) || ((i < 0) && (errno != EAGAIN)))
 		    break;
-		if (i > 0)
+		if (i > 0) {
 		    copyIn(inputState, pty, buf, i);
+		    /* do not hold the echo of a keystroke */
+		    flushIso2022(outputState, sfd);
+		    outputState->flush_now = 1;
+		}
 	    }
 	}
     }
+    finishIso2022(outputState, sfd);
 
     restoreTermios(sfd);
     cleanup_io(sfd, pty);
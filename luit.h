@@ -53,8 +53,6 @@ extern int fill_fontenc;
 extern int ignore_locale;
 extern int iso2022;
 extern int sevenbit;
-extern int ilog;
-extern int olog;
 extern int verbose;
 
 #define MAXCOLS 78
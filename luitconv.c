@@ -26,6 +26,19 @@ THE SOFTWARE.
 
 #include <sys.h>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <signal.h>
+#include <glob.h>
+#include <sys/wait.h>
+
+#if defined(__GLIBC__)
+#include <gnu/libc-version.h>
+#endif
+
 #ifdef HAVE_LANGINFO_CODESET
 #include <locale.h>
 #include <langinfo.h>
@@ -212,6 +225,362 @@ newLuitConv(size_t elts)
     return result;
 }
 
+/******************************************************************************/
+
+/*
+ * Data which other luit processes can reuse is kept in files in share_dir,
+ * named for the user who wrote them.  A file is trusted only if it belongs to
+ * that user (or root) and cannot be changed by others.
+ */
+static char *
+sharedFileName(const char *key, unsigned long owner)
+{
+    char *result = malloc(strlen(share_dir) + strlen(key) + 40);
+
+    if (result != 0) {
+	char *s;
+
+	sprintf(result, "%s/luit-%lu-", share_dir, owner);
+	s = result + strlen(result);
+	while (*key != '\0') {
+	    int ch = UChar(*key++);
+	    *s++ = (char) ((isalnum(ch) || ch == '-' || ch == '.') ? ch : '_');
+	}
+	*s = '\0';
+    }
+    return result;
+}
+
+int
+openSharedFile(const char *key, unsigned long owner, struct stat *sb)
+{
+    char *path;
+    int result = -1;
+    int flags = O_RDONLY;
+
+#ifdef O_NOFOLLOW
+    flags |= O_NOFOLLOW;
+#endif
+    if (share_dir != 0
+	&& *share_dir != '\0'
+	&& (path = sharedFileName(key, owner)) != 0) {
+	if ((result = open(path, flags)) >= 0) {
+	    if (fstat(result, sb) != 0
+		|| !S_ISREG(sb->st_mode)
+		|| (unsigned long) sb->st_uid != owner
+		|| (sb->st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		TRACE(("...not trusted: %s\n", path));
+		close(result);
+		result = -1;
+	    }
+	}
+	free(path);
+    }
+    return result;
+}
+
+/*
+ * Write the given parts to a file in share_dir.  The file is written under a
+ * temporary name and renamed, so that readers never see a partial file.  A
+ * privileged (setuid) luit does not write these files.
+ */
+void
+writeSharedFile(const char *key,
+		const void *const *parts,
+		const size_t *lengths,
+		int count)
+{
+    char *path;
+    char *temp;
+    int fd;
+    int n;
+
+    if (share_dir == 0
+	|| *share_dir == '\0'
+	|| getuid() != geteuid()
+	|| (path = sharedFileName(key, (unsigned long) getuid())) == 0)
+	return;
+
+    if ((temp = malloc(strlen(path) + 8)) != 0) {
+	sprintf(temp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(temp)) >= 0) {
+	    int ok = 1;
+
+	    for (n = 0; n < count && ok; ++n) {
+		if (write(fd, parts[n], lengths[n]) != (ssize_t) lengths[n])
+		    ok = 0;
+	    }
+	    if (fchmod(fd, 0444) != 0)
+		ok = 0;
+	    if (close(fd) != 0)
+		ok = 0;
+	    if (ok && rename(temp, path) == 0) {
+		TRACE(("wrote %s\n", path));
+		VERBOSE(2, ("shared file %s\n", path));
+	    } else {
+		unlink(temp);
+	    }
+	}
+	free(temp);
+    }
+    free(path);
+}
+
+/*
+ * Finding the name which iconv_open accepts may take a dozen calls, and some
+ * of luit's names are not known to iconv at all.  Remember the outcome for
+ * each name tried, and save that in share_dir for the next process when this
+ * one exits.  The saved list is stamped with the iconv version and the time
+ * its modules were configured, and discarded when those change.
+ */
+#define NAMES_KEY	"iconv-names"
+#define NAMES_MAGIC	"luit-iconv-names 1"
+
+typedef struct {
+    char *guess;		/* the name given to try_iconv_open */
+    char *found;		/* the name iconv accepted, or null */
+} IconvName;
+
+static IconvName *iconv_names;
+static size_t num_names;
+static size_t max_names;
+static char *names_stamp;
+static int names_dirty;
+
+/*
+ * Find glibc's module directory, which depends on the platform's naming for
+ * its library directory.  This is needed only when writing the list, since
+ * the stamp records the directory.
+ */
+static char *
+findGconvDir(void)
+{
+    /* *INDENT-OFF* */
+    static const char *const patterns[] = {
+	"/usr/lib/gconv",
+	"/usr/lib64/gconv",
+	"/usr/lib/*/gconv",
+	"/usr/lib32/gconv",
+	"/usr/local/lib/gconv",
+    };
+    /* *INDENT-ON* */
+
+    char *result = 0;
+#if defined(__GLIBC__)
+    size_t j;
+
+    for (j = 0; j < SizeOf(patterns) && result == 0; ++j) {
+	glob_t matches;
+
+	if (glob(patterns[j], GLOB_NOSORT, NULL, &matches) == 0) {
+	    if (matches.gl_pathc != 0)
+		result = strmalloc(matches.gl_pathv[0]);
+	    globfree(&matches);
+	}
+    }
+#else
+    (void) patterns;
+#endif
+    TRACE(("findGconvDir: %s\n", NonNull(result)));
+    return result;
+}
+
+/*
+ * The stamp names the iconv implementation, the time its modules were last
+ * configured, and the module path given in the environment.
+ */
+static char *
+iconvStamp(const char *gconv_dir)
+{
+    char version[80];
+    const char *gconv_path = getenv("GCONV_PATH");
+    time_t latest = 0;
+    char *result;
+
+#if defined(__GLIBC__)
+    sprintf(version, "glibc-%.40s", gnu_get_libc_version());
+#elif defined(_LIBICONV_VERSION)
+    sprintf(version, "libiconv-%d.%d",
+	    _LIBICONV_VERSION >> 8,
+	    _LIBICONV_VERSION & 0xff);
+#else
+    strcpy(version, "unknown");
+#endif
+
+    if (gconv_dir != 0 && strchr(gconv_dir, ' ') == 0) {
+	static const char *const leaves[] =
+	{
+	    "gconv-modules",
+	    "gconv-modules.cache",
+	    "gconv-modules.d"
+	};
+	char *path = malloc(strlen(gconv_dir) + 40);
+	size_t k;
+
+	for (k = 0; k < SizeOf(leaves) && path != 0; ++k) {
+	    struct stat sb;
+
+	    sprintf(path, "%s/%s", gconv_dir, leaves[k]);
+	    if (stat(path, &sb) == 0 && sb.st_mtime > latest)
+		latest = sb.st_mtime;
+	}
+	free(path);
+    } else {
+	gconv_dir = "-";
+    }
+
+    if (gconv_path == 0)
+	gconv_path = "-";
+    if ((result = malloc(strlen(NAMES_MAGIC)
+			 + strlen(version)
+			 + strlen(gconv_dir)
+			 + strlen(gconv_path)
+			 + 40)) != 0) {
+	sprintf(result, "%s %s %s %ld %s",
+		NAMES_MAGIC, version, gconv_dir, (long) latest, gconv_path);
+    }
+    TRACE(("iconvStamp: %s\n", NonNull(result)));
+    return result;
+}
+
+static IconvName *
+findIconvName(const char *guess)
+{
+    IconvName *result = 0;
+    size_t n;
+
+    for (n = 0; n < num_names; ++n) {
+	if (!strcmp(iconv_names[n].guess, guess)) {
+	    result = &(iconv_names[n]);
+	    break;
+	}
+    }
+    return result;
+}
+
+static IconvName *
+addIconvName(const char *guess, const char *found)
+{
+    IconvName *result;
+
+    if ((result = findIconvName(guess)) != 0) {
+	free(result->found);
+    } else {
+	if (num_names >= max_names) {
+	    max_names = (max_names + 8) * 2;
+	    iconv_names = realloc(iconv_names, max_names * sizeof(IconvName));
+	    if (iconv_names == 0)
+		FatalError("Couldn't grow iconv_names array.\n");
+	}
+	result = &(iconv_names[num_names++]);
+	result->guess = strmalloc(guess);
+    }
+    result->found = found ? strmalloc(found) : 0;
+    return result;
+}
+
+static void
+loadIconvNames(void)
+{
+    struct stat sb;
+    int fd;
+
+    if (names_stamp != 0
+	|| share_dir == 0
+	|| *share_dir == '\0')
+	return;
+
+    if ((fd = openSharedFile(NAMES_KEY, (unsigned long) getuid(), &sb)) >= 0) {
+	FILE *fp;
+	char buffer[BUFSIZ];
+	char gconv_dir[BUFSIZ];
+
+	if ((fp = fdopen(fd, "r")) != 0) {
+	    if (fgets(buffer, (int) sizeof(buffer), fp) != 0
+		&& strtok(buffer, "\n") != 0
+		&& sscanf(buffer, "%*s %*s %*s %s", gconv_dir) == 1
+		&& (names_stamp = iconvStamp(gconv_dir)) != 0
+		&& !strcmp(buffer, names_stamp)) {
+		while (fgets(buffer, (int) sizeof(buffer), fp) != 0) {
+		    char *found;
+		    char *s;
+
+		    if ((s = strchr(buffer, '\n')) == 0
+			|| (found = strchr(buffer, '\t')) == 0)
+			continue;
+		    *s = '\0';
+		    *found++ = '\0';
+		    addIconvName(buffer, *found ? found : 0);
+		}
+		TRACE(("loaded %u iconv names\n", (unsigned) num_names));
+	    } else {
+		free(names_stamp);
+		names_stamp = 0;
+	    }
+	    fclose(fp);
+	} else {
+	    close(fd);
+	}
+    }
+
+    if (names_stamp == 0) {
+	char *gconv_dir = findGconvDir();
+	names_stamp = iconvStamp(gconv_dir);
+	free(gconv_dir);
+    }
+}
+
+static void
+saveIconvNames(void)
+{
+    size_t need;
+    size_t n;
+    char *buffer;
+
+    if (!names_dirty || names_stamp == 0)
+	return;
+    names_dirty = 0;
+
+    need = strlen(names_stamp) + 2;
+    for (n = 0; n < num_names; ++n) {
+	need += strlen(iconv_names[n].guess) + 2;
+	if (iconv_names[n].found)
+	    need += strlen(iconv_names[n].found);
+    }
+    if ((buffer = malloc(need)) != 0) {
+	const void *parts[1];
+	size_t lengths[1];
+	char *s = buffer;
+
+	s += sprintf(s, "%s\n", names_stamp);
+	for (n = 0; n < num_names; ++n) {
+	    s += sprintf(s, "%s\t%s\n",
+			 iconv_names[n].guess,
+			 iconv_names[n].found ? iconv_names[n].found : "");
+	}
+	parts[0] = buffer;
+	lengths[0] = (size_t) (s - buffer);
+	writeSharedFile(NAMES_KEY, parts, lengths, 1);
+	free(buffer);
+    }
+}
+
+/*
+ * Record the outcome of a search, unless the names cannot be saved as text.
+ */
+static void
+rememberIconvName(const char *guess, const char *found)
+{
+    if (strpbrk(guess, "\t\n") == 0
+	&& (found == 0 || strpbrk(found, "\t\n") == 0)) {
+	addIconvName(guess, found);
+	if (names_stamp != 0 && !names_dirty) {
+	    names_dirty = 1;
+	    atexit(saveIconvNames);
+	}
+    }
+}
+
 /*
  * Try to open a conversion from UTF-8 to the given encoding name.  This is
  * iconv(), and different implementations expect different syntax for the
@@ -227,9 +596,26 @@ try_iconv_open(const char *guess, char **alias)
     char *encoding_temp = NULL;
     char *p;
     iconv_t result;
+    const IconvName *known;
+
+    if (guess == NULL)
+	return NO_ICONV;
+
+    loadIconvNames();
+    if ((known = findIconvName(guess)) != 0) {
+	if (known->found == NULL) {
+	    TRACE(("try_iconv_open(%s) known to fail\n", guess));
+	    return NO_ICONV;
+	}
+	if ((result = iconv_open("UTF-8", known->found)) != NO_ICONV) {
+	    TRACE(("try_iconv_open(%s) known as \"%s\"\n", guess, known->found));
+	    if (strcmp(known->found, guess))
+		*alias = strmalloc(known->found);
+	    return result;
+	}
+    }
 
-    if (guess == NULL
-	|| (encoding_name = malloc(strlen(guess) + 2)) == NULL
+    if ((encoding_name = malloc(strlen(guess) + 2)) == NULL
 	|| (encoding_temp = malloc(strlen(guess) + 2)) == NULL) {
 	free(encoding_name);
 	return NO_ICONV;
@@ -318,6 +704,8 @@ try_iconv_open(const char *guess, char **alias)
 	}
     }
 
+    rememberIconvName(guess, (result != NO_ICONV) ? encoding_name : NULL);
+
     if (strcmp(encoding_name, guess)) {
 	if (result != NO_ICONV) {
 	    *alias = encoding_name;
@@ -346,8 +734,9 @@ cmp_rindex(const void *a, const void *b)
 static void
 trace_convert(LuitConv * data, size_t which, unsigned gs)
 {
-    size_t j;
     char gsbuf[20];
+    UCHAR text[10];
+    int size;
 
     if (gs) {
 	sprintf(gsbuf, "G%u ", gs);
@@ -355,17 +744,13 @@ trace_convert(LuitConv * data, size_t which, unsigned gs)
 	gsbuf[0] = '\0';
     }
 
-    TRACE(("convert %s%04X:%d:%04X:",
+    size = ConvToUTF8(text, data->table_utf8[which].ucs, sizeof(text));
+    TRACE(("convert %s%04X:%d:%04X:%.*s\n",
 	   gsbuf,
 	   (unsigned) which,
-	   (int) data->table_utf8[which].size,
-	   data->table_utf8[which].ucs));
-    if (data->table_utf8[which].size) {
-	for (j = 0; j < data->table_utf8[which].size; ++j) {
-	    TRACE(("%c", data->table_utf8[which].text[j]));
-	}
-    }
-    TRACE(("\n"));
+	   size,
+	   data->table_utf8[which].ucs,
+	   size, (char *) text));
 }
 #else
 #define trace_convert(data,n,gs)	/* nothing */
@@ -419,8 +804,7 @@ count8bitIconv(iconv_t my_desc)
  * As a quick check, we first count the number of codes going _to_ UTF-8 in the
  * series 0..255, and if that is 256 there is no need for this function.
  *
- * FIXME: improve this by constructing a table of known single-byte encoding
- * names.
+ * This is used only for encodings which are not listed in known_encodings[].
  */
 static unsigned
 sizeofIconvTable(const char *encoding_name, unsigned limit)
@@ -497,18 +881,15 @@ initialize8bitTable(LuitConv * data)
 	if (converted == (size_t) (-1)) {
 	    TRACE(("convert err %d\n", n));
 	} else {
-	    output[sizeof(output) - out_bytes] = 0;
-	    data->table_utf8[n].size = sizeof(output) - out_bytes;
-	    data->table_utf8[n].text = malloc(data->table_utf8[n].size);
-	    memcpy(data->table_utf8[n].text,
-		   output,
-		   data->table_utf8[n].size);
-	    if (ConvToUTF32((UINT *) 0,
-			    data->table_utf8[n].text,
-			    data->table_utf8[n].size)) {
-		ConvToUTF32(&(data->table_utf8[n].ucs),
-			    data->table_utf8[n].text,
-			    data->table_utf8[n].size);
+	    size_t size;
+
+	    /* some converters (e.g., CP1258) hold a character for combining */
+	    (void) iconv(data->iconv_desc, NULL, NULL, &op, &out_bytes);
+	    size = sizeof(output) - out_bytes;
+
+	    output[size] = 0;
+	    if (ConvToUTF32((UINT *) 0, output, size)) {
+		ConvToUTF32(&(data->table_utf8[n].ucs), output, size);
 	    }
 	    trace_convert(data, (size_t) n, 0);
 
@@ -524,7 +905,8 @@ dbcsDecode(const char *buffer, int length, int euc, unsigned *gs)
 {
     UINT result = UChar(buffer[0]);
 
-    switch (result) {
+    /* SS2 and SS3 are ordinary lead-bytes in GBK, Big5, etc. */
+    switch (euc ? result : 0) {
     case SS2:
 	*gs = (unsigned) ((length > 1) ? 2 : 1);
 	break;
@@ -613,6 +995,13 @@ initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
 	    if (iconv(my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1) {
 		continue;
 	    }
+	    /*
+	     * GB18030's four-byte sequences do not fit in this table; they are
+	     * handled arithmetically in other.c
+	     */
+	    if (!euc && (op - output) > 2) {
+		continue;
+	    }
 	    my_code = dbcsDecode(output, (int) (op - output), euc, &gs);
 	    if (gs >= gmax) {
 		data = (gs == 1) ? datap[0] : 0;
@@ -624,8 +1013,6 @@ initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
 		TRACE(("skip %d:%#x\n", gs, my_code));
 		continue;
 	    }
-	    data->table_utf8[my_code].size = strlen((char *) input);
-	    data->table_utf8[my_code].text = strmalloc((char *) input);
 	    data->table_utf8[my_code].ucs = n;
 
 	    trace_convert(data, (size_t) my_code, gs);
@@ -638,15 +1025,281 @@ initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
     }
 }
 
+/******************************************************************************/
+
+/*
+ * The tables built by scanning iconv cost the same in every process which
+ * uses the encoding.  The first process to build one writes it to a file in
+ * share_dir (normally a memory-backed filesystem), and later processes map
+ * that read-only rather than repeating the scan.  If anything is unexpected
+ * in the file, the table is built privately as before.
+ */
+#define SHARED_MAGIC	"luit-tbl"
+#define SHARED_VERSION	1
+#define SHARED_CHECKS	16	/* entries compared with iconv when mapping */
+
+typedef struct {
+    char magic[8];		/* SHARED_MAGIC, without the null */
+    unsigned version;		/* SHARED_VERSION */
+    unsigned map_size;		/* sizeof(MappingData) */
+    unsigned rev_size;		/* sizeof(ReverseData) */
+    unsigned checksum;		/* FNV-1a hash of the two tables */
+    unsigned long table_size;	/* length of table_utf8[] */
+    unsigned long len_index;	/* length of rev_index[] */
+    char name[80];		/* the table's key, for collisions */
+} SharedHeader;
+
+static unsigned
+sharedChecksum(unsigned result, const void *data, size_t length)
+{
+    const UCHAR *p = (const UCHAR *) data;
+
+    while (length-- != 0) {
+	result ^= *p++;
+	result *= 16777619U;
+    }
+    return result;
+}
+
+
+/*
+ * Check the header and content of a mapped file, returning the header if it
+ * holds a table for the given key.
+ */
+static const SharedHeader *
+validSharedTable(const void *addr, size_t size, const char *key, size_t want)
+{
+    const SharedHeader *result = (const SharedHeader *) addr;
+    size_t map_bytes;
+    size_t rev_bytes;
+
+    if (size < sizeof(*result)
+	|| memcmp(result->magic, SHARED_MAGIC, sizeof(result->magic))
+	|| result->version != SHARED_VERSION
+	|| result->map_size != sizeof(MappingData)
+	|| result->rev_size != sizeof(ReverseData)
+	|| result->name[sizeof(result->name) - 1] != '\0'
+	|| strcmp(result->name, key)
+	|| (want != 0 && result->table_size != want)
+	|| result->table_size > MAX16
+	|| result->len_index > result->table_size) {
+	TRACE(("...not a table for %s\n", key));
+	return 0;
+    }
+    map_bytes = (size_t) result->table_size * sizeof(MappingData);
+    rev_bytes = (size_t) result->len_index * sizeof(ReverseData);
+    if (size != sizeof(*result) + map_bytes + rev_bytes
+	|| sharedChecksum(2166136261U,
+			  result + 1,
+			  map_bytes + rev_bytes) != result->checksum) {
+	TRACE(("...table for %s is damaged\n", key));
+	return 0;
+    }
+    return result;
+}
+
+/*
+ * Map a table written by publishSharedTable(), replacing the (empty) tables
+ * allocated for data.  Only files written by this user or root are trusted.
+ */
+static int
+attachSharedTable(LuitConv * data, const char *key, size_t want)
+{
+    unsigned long owners[2];
+    unsigned n;
+    int result = 0;
+
+    owners[0] = (unsigned long) getuid();
+    owners[1] = 0;
+    for (n = 0; n < (owners[0] ? 2U : 1U) && !result; ++n) {
+	int fd;
+	struct stat sb;
+	void *addr;
+	const SharedHeader *header;
+
+	if ((fd = openSharedFile(key, owners[n], &sb)) >= 0) {
+	    if (sb.st_size > 0
+		&& (addr = mmap(0, (size_t) sb.st_size, PROT_READ,
+				MAP_SHARED, fd, (off_t) 0)) != MAP_FAILED) {
+		if ((header = validSharedTable(addr,
+					       (size_t) sb.st_size,
+					       key,
+					       want)) != 0) {
+		    free(data->table_utf8);
+		    free(data->rev_index);
+		    data->table_size = (size_t) header->table_size;
+		    data->len_index = (size_t) header->len_index;
+		    data->table_utf8 = (MappingData *) (void *)
+			((char *) addr + sizeof(*header));
+		    data->rev_index = (ReverseData *) (void *)
+			(data->table_utf8 + data->table_size);
+		    data->shared_addr = addr;
+		    data->shared_size = (size_t) sb.st_size;
+		    TRACE(("attached table for %s\n", key));
+		    result = 1;
+		} else {
+		    munmap(addr, (size_t) sb.st_size);
+		}
+	    }
+	    close(fd);
+	}
+    }
+    return result;
+}
+
+/*
+ * Undo attachSharedTable(), leaving empty tables to build privately.
+ */
+static void
+detachSharedTable(LuitConv * data)
+{
+    if (data->shared_addr != 0) {
+	munmap(data->shared_addr, data->shared_size);
+	data->shared_addr = 0;
+	data->shared_size = 0;
+	data->len_index = 0;
+	data->table_utf8 = TypeCallocN(MappingData, data->table_size);
+	data->rev_index = TypeCallocN(ReverseData, data->table_size);
+    }
+}
+
+/*
+ * A mapped table may be left over from an older iconv.  Compare a sample of
+ * its entries with the current one, in the same direction as they were built.
+ */
+static int
+verifySharedTable(const char *charset,
+		  iconv_t fwd_desc,
+		  LuitConv ** datap,
+		  unsigned gmax)
+{
+    int result = 1;
+    unsigned g;
+    unsigned k;
+    iconv_t my_desc = NO_ICONV;
+    int euc = !isOtherCharset(charset);
+
+    if (gmax == 1 && datap[0]->table_size == MAX8 && fwd_desc != NO_ICONV) {
+	LuitConv *data = datap[0];
+
+	for (k = 0; k < SHARED_CHECKS && result; ++k) {
+	    const ReverseData *rp = data->rev_index
+	    + ((size_t) k * data->len_index) / SHARED_CHECKS;
+	    char input[2];
+	    ICONV_CONST char *ip = input;
+	    char output[80];
+	    char *op = output;
+	    size_t in_bytes = 1;
+	    size_t out_bytes = sizeof(output);
+	    unsigned ucs = 0;
+
+	    if (data->len_index == 0)
+		break;
+	    if (rp->ch >= MAX8) {
+		result = 0;
+		break;
+	    }
+	    input[0] = (char) rp->ch;
+	    (void) iconv(fwd_desc, NULL, NULL, NULL, NULL);
+	    if (iconv(fwd_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1
+		|| iconv(fwd_desc, NULL, NULL, &op, &out_bytes) == (size_t) -1) {
+		result = 0;
+	    } else if (ConvToUTF32((UINT *) 0, output, (size_t) (op - output))) {
+		ConvToUTF32(&ucs, output, (size_t) (op - output));
+	    }
+	    if (ucs != rp->ucs || ucs != data->table_utf8[rp->ch].ucs)
+		result = 0;
+	}
+    } else if ((my_desc = iconv_open(charset, "UTF-8")) == NO_ICONV) {
+	result = 0;
+    } else {
+	for (g = 0; g < gmax && result; ++g) {
+	    LuitConv *data = datap[g];
+
+	    for (k = 0; data != 0 && k < SHARED_CHECKS && result; ++k) {
+		const ReverseData *rp = data->rev_index
+		+ ((size_t) k * data->len_index) / SHARED_CHECKS;
+		UCHAR input[10];
+		ICONV_CONST char *ip = (ICONV_CONST char *) input;
+		char output[80];
+		char *op = output;
+		size_t in_bytes;
+		size_t out_bytes = sizeof(output);
+		unsigned gs;
+
+		if (data->len_index == 0)
+		    break;
+		in_bytes = (size_t) ConvToUTF8(input, rp->ucs, sizeof(input));
+		(void) iconv(my_desc, NULL, NULL, NULL, NULL);
+		if (in_bytes == 0
+		    || iconv(my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1
+		    || dbcsDecode(output, (int) (op - output), euc, &gs) != rp->ch
+		    || ((gs >= gmax) ? (gs == 1 ? 0 : gmax) : gs) != g) {
+		    result = 0;
+		}
+	    }
+	}
+	iconv_close(my_desc);
+    }
+    TRACE(("verifySharedTable(%s) %s\n", NonNull(charset), result ? "OK" : "FAIL"));
+    return result;
+}
+
+/*
+ * Write a table built by scanning iconv, for other processes to map.
+ */
+static void
+publishSharedTable(LuitConv * data, const char *key)
+{
+    SharedHeader header;
+    size_t map_bytes = data->table_size * sizeof(MappingData);
+    size_t rev_bytes = data->len_index * sizeof(ReverseData);
+    const void *parts[3];
+    size_t lengths[3];
+
+    if (data->shared_addr != 0
+	|| strlen(key) >= sizeof(header.name))
+	return;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SHARED_MAGIC, sizeof(header.magic));
+    header.version = SHARED_VERSION;
+    header.map_size = sizeof(MappingData);
+    header.rev_size = sizeof(ReverseData);
+    header.table_size = (unsigned long) data->table_size;
+    header.len_index = (unsigned long) data->len_index;
+    header.checksum = sharedChecksum(sharedChecksum(2166136261U,
+						    data->table_utf8,
+						    map_bytes),
+				     data->rev_index,
+				     rev_bytes);
+    strcpy(header.name, key);
+
+    parts[0] = &header;
+    lengths[0] = sizeof(header);
+    parts[1] = data->table_utf8;
+    lengths[1] = map_bytes;
+    parts[2] = data->rev_index;
+    lengths[2] = rev_bytes;
+    writeSharedFile(key, parts, lengths, 3);
+}
+
 static unsigned
 luitReverse(unsigned code, void *client_data GCC_UNUSED)
 {
     unsigned result = code;
     LuitConv *data = (LuitConv *) client_data;
 
-    TRACE(("luitReverse 0x%04X %p\n", code, (void *) data));
+    if (data != 0 && data->rev_pages != 0) {
+	const unsigned short *page;
+	unsigned page_no = (code >> 8);
 
-    if (data != 0) {
+	if (page_no < data->num_pages
+	    && (page = data->rev_pages[page_no]) != 0
+	    && page[code & 0xff] != 0) {
+	    result = page[code & 0xff];
+	}
+    } else if (data != 0) {
 	static const ReverseData zero_key;
 	ReverseData *p;
 	ReverseData key = zero_key;
@@ -660,12 +1313,94 @@ luitReverse(unsigned code, void *client_data GCC_UNUSED)
 
 	if (p != 0) {
 	    result = p->ch;
-	    TRACE(("...mapped %#x\n", result));
 	}
     }
+    TRACE_EVENT((evLUIT_REVERSE, code, result, 0));
     return result;
 }
 
+/*
+ * Encodings known to luit, with the name which iconv is more likely to accept
+ * (if different), and the size of the table to build, so that we need not
+ * probe iconv for that.  The ISO-2022 character sets are described (with their
+ * final bytes) in fontencCharsets, and need not be repeated here.
+ */
+/* *INDENT-OFF* */
+static const struct {
+    const char *luit_name;
+    const char *iconv_name;
+    US_SIZE size;
+} known_encodings[] = {
+    /* 8-bit character sets */
+    { "KOI8-E",			"ISO-IR-111",		us8BIT },
+    { "TCVN-0",			"TCVN5712-1:1993",	us8BIT },
+    { "ibm-cp437",		"cp437",		us8BIT },
+    { "ibm-cp850",		"cp850",		us8BIT },
+    { "ibm-cp865",		"cp865",		us8BIT },
+    { "ibm-cp866",		"cp866",		us8BIT },
+    { "iso646.1973-0",		"US-ASCII",		us8BIT },
+    { "ISO 646 (1973)",		"US-ASCII",		us8BIT },
+    { "microsoft-cp1250",	"windows-1250",		us8BIT },
+    { "microsoft-cp1251",	"windows-1251",		us8BIT },
+    { "microsoft-cp1252",	"windows-1252",		us8BIT },
+    { "microsoft-cp1255",	"windows-1255",		us8BIT },
+    /* EUC aliases */
+    { "ksx1001.1997-0",		"eucKR",		us16BIT }, /* fontenc -> ksc5601.1987-0 */
+    { "ksxjohab-1",		"JOHAB",		us16BIT },
+    /* other (non-ISO-2022) character sets */
+    { "gb2312.1980-0",		"GB2312",		us16BIT },
+    { "big5.eten-0",		"BIG-5",		us16BIT },
+    { "big5hkscs-0",		"BIG5-HKSCS",		us16BIT },
+    { "gbk-0",			"GBK",			us16BIT },
+    { "gb18030.2000-0",		"GB18030",		us16BIT },
+#if 0
+    { "gb18030.2000-1",		"GB18030",		us16BIT },
+#endif
+    /* locale encodings not listed in fontencCharsets */
+    { "ANSI_X3.4-1968",		0,			us8BIT },
+    { "ARMSCII-8",		0,			us8BIT },
+    { "CP737",			0,			us8BIT },
+    { "CP855",			0,			us8BIT },
+    { "CP857",			0,			us8BIT },
+    { "CP860",			0,			us8BIT },
+    { "CP862",			0,			us8BIT },
+    { "CP863",			0,			us8BIT },
+    { "CP869",			0,			us8BIT },
+    { "CP874",			0,			us8BIT },
+    { "CP1253",			0,			us8BIT },
+    { "CP1254",			0,			us8BIT },
+    { "CP1256",			0,			us8BIT },
+    { "CP1257",			0,			us8BIT },
+    { "CP1258",			0,			us8BIT },
+    { "GEORGIAN-PS",		0,			us8BIT },
+    { "HP-ROMAN8",		0,			us8BIT },
+    { "ISO-8859-9E",		0,			us8BIT },
+    { "KOI8-T",			0,			us8BIT },
+    { "MACINTOSH",		0,			us8BIT },
+    { "PT154",			0,			us8BIT },
+    { "RK1048",			0,			us8BIT },
+    { "TCVN5712-1",		0,			us8BIT },
+    { "US-ASCII",		0,			us8BIT },
+    { "VISCII",			0,			us8BIT },
+    { "BIG5",			0,			us16BIT },
+    { "BIG5-HKSCS",		0,			us16BIT },
+    { "CP932",			0,			us16BIT },
+    { "CP936",			0,			us16BIT },
+    { "CP949",			0,			us16BIT },
+    { "CP950",			0,			us16BIT },
+    { "EUC-CN",			0,			us16BIT },
+    { "EUC-JISX0213",		0,			us16BIT },
+    { "EUC-JP",			0,			us16BIT },
+    { "EUC-KR",			0,			us16BIT },
+    { "EUC-TW",			0,			us16BIT },
+    { "JOHAB",			0,			us16BIT },
+    { "SHIFT_JIS",		0,			us16BIT },
+    { "SHIFT_JISX0213",		0,			us16BIT },
+    { "SJIS",			0,			us16BIT },
+    { "UHC",			0,			us16BIT },
+};
+/* *INDENT-ON* */
+
 /*
  * Translate one of luit's encoding names to one which is more likely to
  * work with iconv.
@@ -673,45 +1408,14 @@ luitReverse(unsigned code, void *client_data GCC_UNUSED)
 static const char *
 findEncodingAlias(const char *encoding_name)
 {
-    /* *INDENT-OFF* */
-    static const struct {
-	const char *luit_name;
-	const char *iconv_name;
-    } table[] = {
-	/* 8-bit character sets */
-	{ "KOI8-E",		"ISO-IR-111" },
-	{ "TCVN-0",		"TCVN5712-1:1993" },
-	{ "ibm-cp437",		"cp437" },
-	{ "ibm-cp850",		"cp850" },
-	{ "ibm-cp865",		"cp865" },
-	{ "ibm-cp866",		"cp866" },
-	{ "iso646.1973-0",	"US-ASCII" },
-	{ "ISO 646 (1973)",     "US-ASCII" },
-	{ "microsoft-cp1250",   "windows-1250" },
-	{ "microsoft-cp1251",   "windows-1251" },
-	{ "microsoft-cp1252",   "windows-1252" },
-	/* EUC aliases */
-	{ "ksx1001.1997-0",     "eucKR" }, /* fontenc -> ksc5601.1987-0 */
-	{ "ksxjohab-1",         "JOHAB" },
-	/* other (non-ISO-2022) character sets */
-	{ "gb2312.1980-0",	"GB2312" },
-	{ "big5.eten-0",	"BIG-5" },
-	{ "big5hkscs-0",        "BIG5-HKSCS" },
-	{ "gbk-0",	        "GBK" },
-	{ "gb18030.2000-0",     "GB18030" },
-#if 0
-	{ "gb18030.2000-1",     "GB18030" },
-#endif
-    };
-    /* *INDENT-ON* */
-
     size_t n;
     const char *result = 0;
 
     TRACE(("findEncodingAlias(%s)\n", NonNull(encoding_name)));
-    for (n = 0; n < SizeOf(table); ++n) {
-	if (!lcStrCmp(encoding_name, table[n].luit_name)) {
-	    result = table[n].iconv_name;
+    for (n = 0; n < SizeOf(known_encodings); ++n) {
+	if (known_encodings[n].iconv_name != 0
+	    && !lcStrCmp(encoding_name, known_encodings[n].luit_name)) {
+	    result = known_encodings[n].iconv_name;
 	    TRACE(("... matched '%s'\n", NonNull(result)));
 	    break;
 	}
@@ -719,14 +1423,50 @@ findEncodingAlias(const char *encoding_name)
     return result;
 }
 
+/*
+ * Return the table size for a known encoding, or zero if we must ask iconv.
+ */
+static size_t
+knownTableSize(const char *encoding_name)
+{
+    size_t n;
+    size_t result = 0;
+    const FontencCharsetRec *fc;
+
+    for (n = 0; n < SizeOf(known_encodings); ++n) {
+	if (!lcStrCmp(encoding_name, known_encodings[n].luit_name)
+	    || (known_encodings[n].iconv_name != 0
+		&& !lcStrCmp(encoding_name, known_encodings[n].iconv_name))) {
+	    result = ((known_encodings[n].size == us8BIT)
+		      ? MAX8
+		      : MAX16);
+	    break;
+	}
+    }
+    if (result == 0 && (fc = getFontencByName(encoding_name)) != 0) {
+	switch (fc->type) {
+	case T_94:
+	case T_96:
+	case T_128:
+	    result = MAX8;
+	    break;
+	case T_9494:
+	case T_9696:
+	case T_94192:
+	    result = MAX16;
+	    break;
+	}
+    }
+    TRACE(("knownTableSize(%s) = %u\n", NonNull(encoding_name), (unsigned) result));
+    return result;
+}
+
 static void
 initializeBuiltInTable(LuitConv * data,
 		       const BuiltInCharsetRec * builtIn,
 		       int enc_file)
 {
-    UCHAR buffer[20];
     size_t n;
-    size_t need;
 
     TRACE(("initializing %s '%s'\n",
 	   enc_file ? "external" : "built-in",
@@ -745,14 +1485,6 @@ initializeBuiltInTable(LuitConv * data,
 
 	    data->table_utf8[j].ucs = builtIn->table[n].target;
 
-	    if ((need = (size_t) ConvToUTF8(buffer,
-					    data->table_utf8[j].ucs,
-					    sizeof(buffer) - 1)) != 0) {
-		data->table_utf8[j].text = malloc(need + 1);
-		data->table_utf8[j].size = need;
-		memcpy(data->table_utf8[j].text, buffer, need);
-	    }
-
 	    trace_convert(data, j, 0);
 
 	    data->rev_index[data->len_index].ucs = data->table_utf8[j].ucs;
@@ -760,18 +1492,35 @@ initializeBuiltInTable(LuitConv * data,
 	    data->len_index++;
 	}
     }
+
+    /* the generated tables come with their reverse-mapping */
+    data->rev_pages = builtIn->pages;
+    data->num_pages = builtIn->num_pages;
 }
 
+/*
+ * The 8-bit tables are always built-in; the two-byte tables are optional,
+ * generated by "make cjk-tables" from the fontenc data.
+ */
+static const BuiltInCharsetRec *const builtin_lists[] =
+{
+    builtin_encodings,
+    builtin_cjk_encodings
+};
+
 static const BuiltInCharsetRec *
 findBuiltinEncoding(const char *encoding_name)
 {
-    size_t n;
+    size_t j, n;
     const BuiltInCharsetRec *result = 0;
 
-    for (n = 0; builtin_encodings[n].name != 0; ++n) {
-	if (!lcStrCmp(encoding_name, builtin_encodings[n].name)) {
-	    result = &(builtin_encodings[n]);
-	    break;
+    for (j = 0; (result == 0) && (j < SizeOf(builtin_lists)); ++j) {
+	const BuiltInCharsetRec *list = builtin_lists[j];
+	for (n = 0; list[n].name != 0; ++n) {
+	    if (!lcStrCmp(encoding_name, list[n].name)) {
+		result = &(list[n]);
+		break;
+	    }
 	}
     }
 
@@ -827,7 +1576,7 @@ luitGetFontEnc(const char *name, UM_MODE mode)
 	mq->len = (unsigned) lc->table_size;
 	mq->map = map;
 
-	for (n = 0; n < (int) lc->table_size; ++n) {
+	for (n = 0; n < (int) lc->len_index; ++n) {
 	    unsigned ch = lc->rev_index[n].ch;
 	    if (ch < mq->len) {
 		map[ch] = (UCode) lc->rev_index[n].ucs;
@@ -889,6 +1638,35 @@ finishIconvTable(LuitConv * latest)
     TRACE(("...finished LuitConv table for \"%s\"\n", NonNull(latest->encoding_name)));
 }
 
+/*
+ * Use a table published by another process for this encoding, if possible.
+ */
+static LuitConv *
+sharedLuitConv(const char *encoding_name, iconv_t my_desc, US_SIZE size)
+{
+    LuitConv *result = TypeCalloc(LuitConv);
+    size_t want = ((size == us8BIT)
+		   ? MAX8
+		   : ((size == us16BIT)
+		      ? MAX16
+		      : 0));
+
+    if (result != 0) {
+	if (attachSharedTable(result, encoding_name, want)
+	    && verifySharedTable(encoding_name, my_desc, &result, 1)) {
+	    result->encoding_name = strmalloc(encoding_name);
+	    result->iconv_desc = my_desc;
+	    VERBOSE(2, ("using shared table for %s\n", encoding_name));
+	} else {
+	    if (result->shared_addr != 0)
+		munmap(result->shared_addr, result->shared_size);
+	    free(result);
+	    result = 0;
+	}
+    }
+    return result;
+}
+
 static FontMapPtr
 initLuitConv(const char *encoding_name,
 	     iconv_t my_desc,
@@ -901,6 +1679,12 @@ initLuitConv(const char *encoding_name,
     unsigned fast;
     size_t length = MAX8;
 
+    if (builtIn == 0
+	&& (latest = sharedLuitConv(encoding_name, my_desc, size)) != 0) {
+	finishIconvTable(latest);
+	return &(latest->mapping);
+    }
+
     switch (size) {
     case us8BIT:
 	length = MAX8;
@@ -921,8 +1705,10 @@ initLuitConv(const char *encoding_name,
 	    } else {
 		length = MAX16;
 	    }
-	} else if ((fast = count8bitIconv(my_desc)) < 256) {
-	    length = sizeofIconvTable(encoding_name, fast);
+	} else if ((length = knownTableSize(encoding_name)) == 0) {
+	    length = MAX8;
+	    if ((fast = count8bitIconv(my_desc)) < 256)
+		length = sizeofIconvTable(encoding_name, fast);
 	}
 	break;
     }
@@ -942,12 +1728,14 @@ initLuitConv(const char *encoding_name,
 	result = &(latest->mapping);
 
 	/* sort the reverse-index, to allow using bsearch */
-	if (result != 0) {
+	if (result != 0 && latest->rev_pages == 0) {
 	    qsort(latest->rev_index,
 		  latest->len_index,
 		  sizeof(latest->rev_index[0]),
 		  cmp_rindex);
 	}
+	if (builtIn == 0)
+	    publishSharedTable(latest, latest->encoding_name);
     }
     return result;
 }
@@ -1023,6 +1811,8 @@ loadCompositeCharset(iconv_t my_desc, const char *composite_name)
     unsigned g;
     unsigned gmax = 0;
     unsigned csize = 0;
+    char *key;
+    int shared = 0;
 
     /*
      * This is the first time we have tried for the composite.  Make
@@ -1059,12 +1849,44 @@ loadCompositeCharset(iconv_t my_desc, const char *composite_name)
 	}
     }
 
+    /*
+     * If another process has already loaded the charset, use its tables.
+     */
+    if ((key = malloc(strlen(composite_name) + 20)) != 0) {
+	shared = (gmax != 0);
+	for (g = 0; g < gmax && shared; ++g) {
+	    if (work[g] != 0) {
+		sprintf(key, "%s.%u", composite_name, g);
+		shared = attachSharedTable(work[g], key, work[g]->table_size);
+	    }
+	}
+	if (shared)
+	    shared = verifySharedTable(composite_name, NO_ICONV, work, gmax);
+	if (!shared) {
+	    for (g = 0; g < gmax; ++g) {
+		if (work[g] != 0)
+		    detachSharedTable(work[g]);
+	    }
+	}
+    }
+
     /*
      * Now, load the charset, filling out the appropriate forward mapping
      * in each one according to the shift-information embedded in the
      * reverse mapping string.
      */
-    initialize16bitTable(composite_name, work, gmax);
+    if (shared) {
+	VERBOSE(2, ("using shared tables for %s\n", composite_name));
+    } else {
+	initialize16bitTable(composite_name, work, gmax);
+	for (g = 0; g < gmax && key != 0; ++g) {
+	    if (work[g] != 0) {
+		sprintf(key, "%s.%u", composite_name, g);
+		publishSharedTable(work[g], key);
+	    }
+	}
+    }
+    free(key);
     /*
      * Finally, link the parts into the list of loaded charsets so we
      * will not repeat this process.
@@ -1126,6 +1948,9 @@ lookupIconv(const char **encoding_name, char **aliased, US_SIZE size)
 	if ((latest = luitLookupEncoding(result)) != 0) {
 	    latest->iconv_desc = NO_ICONV;
 	}
+    } else if ((fc = getFontencByName(*encoding_name)) != 0
+	       && (result = getFontMapByName(fc->name)) != 0) {
+	TRACE(("...already loaded as part of a composite\n"));
     } else if ((full = getCompositeCharset(*encoding_name)) != 0
 	       && (check = try_iconv_open(full, aliased)) != NO_ICONV) {
 	loadCompositeCharset(check, full);
@@ -1178,7 +2003,7 @@ luitLookupMapping(const char *encoding_name, UM_MODE mode, US_SIZE size)
 					  NO_ICONV,
 					  builtIn,
 					  0,
-					  us8BIT);
+					  usANY);
 		}
 		break;
 	    case umPOSIX:
@@ -1253,96 +2078,256 @@ luitMapCodeValue(unsigned code, FontMapPtr fontmap_ptr)
 	}
     }
 
-    TRACE2(("luitMapCodeValue 0x%04X '%c' 0x%04X\n",
-	    code,
-	    isprint(code) ? code : ' ',
-	    result));
+    TRACE_EVENT((evMAPCODE, code, result, 0));
+    return result;
+}
+
+/*
+ * The tables built from iconv, fontenc and the built-in data hold only the
+ * BMP, and those scanned from iconv hold one code for each character.  Ask
+ * iconv directly for a two-byte code which they do not map, e.g., one which
+ * Big5-HKSCS or GB18030 maps into plane 2.  Returns the codepoint, or 0 if
+ * iconv does not give a single character.
+ */
+static iconv_t decode_desc = NO_ICONV;
+static char *decode_name;
+
+unsigned
+luitDecodeIconv(const char *encoding_name, unsigned code)
+{
+    unsigned result = 0;
+
+    if (decode_name == 0 || strcmp(decode_name, encoding_name)) {
+	char *aliased = 0;
+	const char *alias;
+
+	if (decode_desc != NO_ICONV)
+	    iconv_close(decode_desc);
+	free(decode_name);
+	decode_name = strmalloc(encoding_name);
+	decode_desc = try_iconv_open(encoding_name, &aliased);
+	if (decode_desc == NO_ICONV
+	    && (alias = findEncodingAlias(encoding_name)) != 0) {
+	    free(aliased);
+	    aliased = 0;
+	    decode_desc = try_iconv_open(alias, &aliased);
+	}
+	free(aliased);
+    }
+
+    if (decode_desc != NO_ICONV) {
+	char input[2];
+	ICONV_CONST char *ip = input;
+	char output[80];
+	char *op = output;
+	size_t in_bytes = sizeof(input);
+	size_t out_bytes = sizeof(output);
+	unsigned ucs;
+
+	input[0] = (char) (code >> 8);
+	input[1] = (char) code;
+	(void) iconv(decode_desc, NULL, NULL, NULL, NULL);
+	if (iconv(decode_desc, &ip, &in_bytes, &op, &out_bytes) != (size_t) -1
+	    && iconv(decode_desc, NULL, NULL, &op, &out_bytes) != (size_t) -1
+	    && op != output
+	    && ConvToUTF32(&ucs, output, (size_t) (op - output)) == (int) (op - output)) {
+	    result = ucs;
+	}
+    }
     return result;
 }
 
 #if defined(HAVE_LANGINFO_CODESET)
 typedef struct {
     char *encoding;
-    char **locales;
-    size_t length;		/* amount used in locales[] */
-    size_t actual;		/* allocated size of locales[] */
+    char *locale;
 } CODESET_LOCALE;
 
+/*
+ * Sorting by encoding, then locale, groups the locales for each encoding and
+ * puts any duplicates next to each other.
+ */
 static int
-compare_encodings(const void *a, const void *b)
+compare_codesets(const void *a, const void *b)
 {
     const CODESET_LOCALE *p = a;
     const CODESET_LOCALE *q = b;
-    return strcmp(p->encoding, q->encoding);
+    int rc = strcmp(p->encoding, q->encoding);
+    if (rc == 0)
+	rc = strcmp(p->locale, q->locale);
+    return rc;
 }
 
-static int
-compare_locales(const void *a, const void *b)
+/*
+ * Probing a few hundred locales is slow enough to be worth splitting among
+ * several processes, but not a few dozen.
+ */
+#define LOCALES_PER_WORKER 64
+#define MAX_LOCALE_WORKERS 8
+
+#define LOCALES_KEY	"locales"
+#define LOCALES_MAGIC	"luit-locales 1"
+
+/*
+ * Return the codeset for the given locale, without changing our own locale
+ * if newlocale is available.
+ */
+static char *
+localeCodeset(const char *name)
 {
-    const char *const *p = a;
-    const char *const *q = b;
-    return strcmp(*p, *q);
+    char *result = 0;
+#ifdef HAVE_NEWLOCALE
+    locale_t loc;
+
+    if ((loc = newlocale(LC_CTYPE_MASK, name, (locale_t) 0)) != (locale_t) 0) {
+	result = strmalloc(nl_langinfo_l(CODESET, loc));
+	freelocale(loc);
+    }
+#else
+    if (setlocale(LC_CTYPE, name) != 0)
+	result = strmalloc(nl_langinfo(CODESET));
+#endif
+    return result;
 }
+
+static int
+localeWorkers(size_t count)
+{
+    long result = (long) (count / LOCALES_PER_WORKER);
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 0 && result > cpus)
+	result = cpus;
 #endif
+    if (result > MAX_LOCALE_WORKERS)
+	result = MAX_LOCALE_WORKERS;
+    return (int) result;
+}
 
 /*
- * Report a list of the built-in encodings (used for fallback)
+ * Each worker probes every n'th locale, writing the index and codeset of each
+ * to a pipe.  Return false if the workers could not finish, leaving the
+ * caller to do the work.
  */
-int
-reportBuiltinCharsets(void)
+static int
+probeInWorkers(CODESET_LOCALE * list, size_t count, int workers)
 {
-    size_t j, k;
+    FILE *pipes[MAX_LOCALE_WORKERS];
+    pid_t pids[MAX_LOCALE_WORKERS];
+    int result = 1;
+    int started;
+    int k;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (started = 0; started < workers; ++started) {
+	int fds[2];
+
+	if (pipe(fds) != 0)
+	    break;
+	if ((pids[started] = fork()) < 0) {
+	    close(fds[0]);
+	    close(fds[1]);
+	    break;
+	} else if (pids[started] == 0) {
+	    FILE *fp;
+	    size_t n;
+
+	    close(fds[0]);
+	    for (k = 0; k < started; ++k)
+		fclose(pipes[k]);
+	    if ((fp = fdopen(fds[1], "w")) == 0)
+		_exit(EXIT_FAILURE);
+	    for (n = (size_t) started; n < count; n += (size_t) workers) {
+		char *codeset = localeCodeset(list[n].locale);
+		if (codeset != 0)
+		    fprintf(fp, "%lu\t%s\n", (unsigned long) n, codeset);
+	    }
+	    _exit(fclose(fp) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	close(fds[1]);
+	if ((pipes[started] = fdopen(fds[0], "r")) == 0) {
+	    close(fds[0]);
+	    kill(pids[started], SIGTERM);
+	    waitpid(pids[started], NULL, 0);
+	    break;
+	}
+    }
 
-    printf("These encodings are used if iconv/fontenc data are missing:\n");
-    printf("\n");
-    for (j = 0; builtin_encodings[j].name != 0; ++j) {
-	const BuiltInCharsetRec *p = &(builtin_encodings[j]);
-	unsigned lo = p->table[0].source;
-	unsigned hi = lo;
+    for (k = 0; k < started; ++k) {
+	char buffer[BUFSIZ];
+	int status;
+
+	if (result) {
+	    while (fgets(buffer, (int) sizeof(buffer), pipes[k]) != 0) {
+		char *codeset;
+		char *s;
+		unsigned long n = strtoul(buffer, &codeset, 10);
+
+		if (*codeset++ != '\t'
+		    || n >= count
+		    || (s = strchr(codeset, '\n')) == 0)
+		    continue;
+		*s = '\0';
+		free(list[n].encoding);
+		list[n].encoding = strmalloc(codeset);
+	    }
+	}
+	fclose(pipes[k]);
+	while (waitpid(pids[k], &status, 0) < 0 && errno == EINTR) {
+	    ;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+	    result = 0;
+    }
+    if (started < workers)
+	result = 0;
+    TRACE(("probeInWorkers(%u): %d of %d workers, %s\n",
+	   (unsigned) count, started, workers, result ? "ok" : "failed"));
+    return result;
+}
+
+static void
+probeLocales(CODESET_LOCALE * list, size_t count)
+{
+    int workers = localeWorkers(count);
+
+    if (workers < 2 || !probeInWorkers(list, count, workers)) {
+	size_t n;
+#ifndef HAVE_NEWLOCALE
+	char *old_locale;
 
-	printf("%s\n", builtin_encodings[j].name);
-	for (k = 1; k < p->length; ++k) {
-	    if (lo > p->table[k].source)
-		lo = p->table[k].source;
-	    if (hi < p->table[k].source)
-		hi = p->table[k].source;
+	if ((old_locale = setlocale(LC_CTYPE, NULL)) != 0)
+	    old_locale = strmalloc(old_locale);
+#endif
+
+	for (n = 0; n < count; ++n) {
+	    if (list[n].encoding == 0)
+		list[n].encoding = localeCodeset(list[n].locale);
 	}
-	printf("\tData: [%04X..%04X] defined %u\n",
-	       lo, hi, (unsigned) p->length);
+#ifndef HAVE_NEWLOCALE
+	setlocale(LC_CTYPE, old_locale);
+	free(old_locale);
+#endif
     }
-    return EXIT_SUCCESS;
 }
 
 /*
- * Obtain a list of supported locales, and for each obtain the corresponding
- * charset.
+ * Obtain the list of locales.  Their order does not matter.
  */
-int
-reportIconvCharsets(void)
+static CODESET_LOCALE *
+listLocales(size_t *countp)
 {
-#if !defined(HAVE_LANGINFO_CODESET)
-    int rc = EXIT_FAILURE;
-
-    Message("nl_langinfo(CODESET) not supported\n");
-#else
-    int rc = EXIT_SUCCESS;
-
     FILE *fp;
-    char *old_locale;
-    char **allLs = 0;
-    size_t numLs = 0;
-    size_t useLs = 0;
-
-    /* save our current locale */
-    if ((old_locale = setlocale(LC_CTYPE, NULL)) != 0)
-	old_locale = strmalloc(old_locale);
+    CODESET_LOCALE *result = 0;
+    size_t count = 0;
+    size_t limit = 0;
 
-    /*
-     * next, obtain the list of locales.  Their order does not matter.
-     */
     if ((fp = popen("locale -a", "r")) != 0) {
 	char buffer[BUFSIZ];
 	char *s;
+
 	while (fgets(buffer, (int) sizeof(buffer) - 1, fp) != 0) {
 	    s = buffer + strlen(buffer);
 	    while (s != buffer) {
@@ -1352,90 +2337,245 @@ reportIconvCharsets(void)
 		else
 		    break;
 	    }
-	    if ((long) useLs >= (long) numLs) {
-		numLs = (useLs + 32) * 3 / 2;
-		allLs = realloc(allLs, (numLs + 2) * sizeof(*allLs));
-		if (allLs == NULL) {
-		    FatalError("Couldn't grow allLs array.\n");
+	    if (*buffer == '\0')
+		continue;
+	    if (count >= limit) {
+		limit = (count + 32) * 3 / 2;
+		result = realloc(result, limit * sizeof(*result));
+		if (result == NULL) {
+		    FatalError("Couldn't grow locale array.\n");
 		}
 	    }
-	    allLs[useLs++] = strmalloc(buffer);
-	    allLs[useLs] = 0;
+	    result[count].locale = strmalloc(buffer);
+	    result[count].encoding = 0;
+	    ++count;
 	}
 	pclose(fp);
     }
+    *countp = count;
+    return result;
+}
 
-    /* now, for each locale, set our locale to that and ask for the charset */
-    if (allLs != 0) {
-	int j, k, enc, loc;
-	char *resolved;
-	CODESET_LOCALE *allEs = 0;
-	size_t n, t, col, now;
-	size_t useEs = 0;
-	size_t numEs = 0;
-
-	for (j = 0; allLs[j] != 0; ++j) {
-	    setlocale(LC_CTYPE, allLs[j]);
-	    if ((resolved = nl_langinfo(CODESET)) != 0) {
-		enc = -1;
-		for (k = 0; k < (int) useEs; ++k) {
-		    if (!strcmp(resolved, allEs[k].encoding)) {
-			enc = k;
-			break;
-		    }
-		}
-		if (enc < 0) {
-		    if ((long) useEs >= (long) numEs) {
-			numEs = (useEs + 32) * 3 / 2;
-			allEs = realloc(allEs, numEs * sizeof(*allEs));
-			if (allEs == NULL) {
-			    FatalError("Couldn't grow allEs array.\n");
+/*
+ * The list of locales changes when locales are added or removed, or if the C
+ * library is updated.
+ */
+static char *
+localesStamp(void)
+{
+    static const char *const paths[] =
+    {
+	"/usr/lib/locale",
+	"/usr/lib/locale/locale-archive",
+	"/usr/share/locale/locale.alias",
+	"/etc/locale.alias",
+    };
+    char version[80];
+    const char *locpath = getenv("LOCPATH");
+    time_t latest = 0;
+    size_t k;
+    char *result;
+
+#if defined(__GLIBC__)
+    sprintf(version, "glibc-%.40s", gnu_get_libc_version());
+#else
+    strcpy(version, "unknown");
+#endif
+    for (k = 0; k < SizeOf(paths); ++k) {
+	struct stat sb;
+
+	if (stat(paths[k], &sb) == 0 && sb.st_mtime > latest)
+	    latest = sb.st_mtime;
+    }
+    if (locpath == 0 || *locpath == '\0')
+	locpath = "-";
+    if ((result = malloc(strlen(LOCALES_MAGIC)
+			 + strlen(version)
+			 + strlen(locpath)
+			 + 40)) != 0) {
+	sprintf(result, "%s %s %ld %s",
+		LOCALES_MAGIC, version, (long) latest, locpath);
+    }
+    TRACE(("localesStamp: %s\n", NonNull(result)));
+    return result;
+}
+
+static CODESET_LOCALE *
+loadLocaleCodesets(const char *stamp, size_t *countp)
+{
+    CODESET_LOCALE *result = 0;
+    size_t count = 0;
+    size_t limit = 0;
+    struct stat sb;
+    int fd;
+
+    if ((fd = openSharedFile(LOCALES_KEY, (unsigned long) getuid(), &sb)) >= 0) {
+	FILE *fp;
+	char buffer[BUFSIZ];
+
+	if ((fp = fdopen(fd, "r")) != 0) {
+	    if (fgets(buffer, (int) sizeof(buffer), fp) != 0
+		&& strtok(buffer, "\n") != 0
+		&& !strcmp(buffer, stamp)) {
+		while (fgets(buffer, (int) sizeof(buffer), fp) != 0) {
+		    char *codeset;
+		    char *s;
+
+		    if ((s = strchr(buffer, '\n')) == 0
+			|| (codeset = strchr(buffer, '\t')) == 0)
+			continue;
+		    *s = '\0';
+		    *codeset++ = '\0';
+		    if (count >= limit) {
+			limit = (count + 32) * 3 / 2;
+			result = realloc(result, limit * sizeof(*result));
+			if (result == NULL) {
+			    FatalError("Couldn't grow locale array.\n");
 			}
 		    }
-		    allEs[useEs].encoding = strmalloc(resolved);
-		    allEs[useEs].locales = 0;
-		    allEs[useEs].actual = 0;
-		    allEs[useEs].length = 0;
-		    enc = (int) useEs;
-		    ++useEs;
+		    result[count].locale = strmalloc(buffer);
+		    result[count].encoding = strmalloc(codeset);
+		    ++count;
 		}
-		loc = -1;
-		for (k = 0; k < (int) allEs[enc].length; ++k) {
-		    if (!strcmp(allLs[j], allEs[enc].locales[k])) {
-			loc = k;
-			break;
-		    }
-		}
-		if (loc < 0) {
-		    if ((long) allEs[enc].length >=
-			(long) allEs[enc].actual) {
-			allEs[enc].actual = ((allEs[enc].length
-					      + 32) * 3 / 2);
-			allEs[enc].locales = realloc(allEs[enc].locales,
-						     (allEs[enc].actual + 2)
-						     * sizeof(char *));
-		    }
-		    loc = (int) allEs[enc].length;
-		    allEs[enc].length++;
-		}
-		allEs[enc].locales[loc] = allLs[j];
-		allEs[enc].locales[loc + 1] = 0;
+		TRACE(("loaded %u locales\n", (unsigned) count));
 	    }
+	    fclose(fp);
+	} else {
+	    close(fd);
 	}
+    }
+    *countp = count;
+    return result;
+}
 
-	/* set our locale back to the starting one */
-	setlocale(LC_CTYPE, old_locale);
+static void
+saveLocaleCodesets(const char *stamp, CODESET_LOCALE * list, size_t count)
+{
+    size_t need = strlen(stamp) + 2;
+    size_t n;
+    char *buffer;
+
+    for (n = 0; n < count; ++n) {
+	need += strlen(list[n].locale) + strlen(list[n].encoding) + 2;
+    }
+    if ((buffer = malloc(need)) != 0) {
+	const void *parts[1];
+	size_t lengths[1];
+	char *s = buffer;
+
+	s += sprintf(s, "%s\n", stamp);
+	for (n = 0; n < count; ++n) {
+	    s += sprintf(s, "%s\t%s\n", list[n].locale, list[n].encoding);
+	}
+	parts[0] = buffer;
+	lengths[0] = (size_t) (s - buffer);
+	writeSharedFile(LOCALES_KEY, parts, lengths, 1);
+	free(buffer);
+    }
+}
+#endif
+
+/*
+ * Report a list of the built-in encodings (used for fallback)
+ */
+int
+reportBuiltinCharsets(void)
+{
+    size_t i, j, k;
+
+    printf("These encodings are used if iconv/fontenc data are missing:\n");
+    printf("\n");
+    for (i = 0; i < SizeOf(builtin_lists); ++i) {
+	for (j = 0; builtin_lists[i][j].name != 0; ++j) {
+	    const BuiltInCharsetRec *p = &(builtin_lists[i][j]);
+	    unsigned lo = p->table[0].source;
+	    unsigned hi = lo;
+
+	    printf("%s\n", p->name);
+	    for (k = 1; k < p->length; ++k) {
+		if (lo > p->table[k].source)
+		    lo = p->table[k].source;
+		if (hi < p->table[k].source)
+		    hi = p->table[k].source;
+	    }
+	    printf("\tData: [%04X..%04X] defined %u\n",
+		   lo, hi, (unsigned) p->length);
+	}
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Obtain a list of supported locales, and for each obtain the corresponding
+ * charset.  The result is saved in share_dir, since asking for each locale
+ * is slow when many are installed.
+ */
+int
+reportIconvCharsets(void)
+{
+#if !defined(HAVE_LANGINFO_CODESET)
+    int rc = EXIT_FAILURE;
+
+    Message("nl_langinfo(CODESET) not supported\n");
+#else
+    int rc = EXIT_SUCCESS;
+
+    char *stamp = 0;
+    CODESET_LOCALE *allLs = 0;
+    size_t useLs = 0;
+    size_t n, t;
+
+    if (share_dir != 0 && *share_dir != '\0') {
+	if ((stamp = localesStamp()) != 0)
+	    allLs = loadLocaleCodesets(stamp, &useLs);
+    }
+    if (allLs == 0) {
+	allLs = listLocales(&useLs);
+	probeLocales(allLs, useLs);
+
+	/* drop the locales for which we found no charset */
+	for (n = t = 0; n < useLs; ++n) {
+	    if (allLs[n].encoding != 0) {
+		allLs[t++] = allLs[n];
+	    } else {
+		free(allLs[n].locale);
+	    }
+	}
+	if (t != 0 && stamp != 0)
+	    saveLocaleCodesets(stamp, allLs, t);
+	if (t == 0) {
+	    free(allLs);
+	    allLs = 0;
+	}
+	useLs = t;
+    }
+
+    if (allLs != 0) {
+	size_t useEs = 0;
+	size_t col, now;
+
+	qsort(allLs, useLs, sizeof(allLs[0]), compare_codesets);
+	for (n = 0; n < useLs; ++n) {
+	    if (n == 0 || strcmp(allLs[n].encoding, allLs[n - 1].encoding))
+		++useEs;
+	}
 
 	/* print the result */
 	if (useEs != 0) {
 	    printf("Iconv supports %ld encodings\n", (long) useEs);
-	    qsort(allEs, useEs, sizeof(allEs[0]), compare_encodings);
-	    for (n = 0; n < useEs; ++n) {
-		printf("  %s\n", allEs[n].encoding);
-		qsort(allEs[n].locales, allEs[n].length, sizeof(char *), compare_locales);
+	    for (n = 0; n < useLs; n = t) {
+		printf("  %s\n", allLs[n].encoding);
 		col = 0;
-		for (t = 0; t < allEs[n].length; ++t) {
-		    now = strlen(allEs[n].locales[t]);
+		for (t = n; t < useLs; ++t) {
+		    if (strcmp(allLs[t].encoding, allLs[n].encoding))
+			break;
+		    if (t != n && !strcmp(allLs[t].locale, allLs[t - 1].locale))
+			continue;
+		    if (col != 0) {
+			printf(", ");
+			col += 2;
+		    }
+		    now = strlen(allLs[t].locale);
 		    if (col + now + 2 > MAXCOLS) {
 			printf("\n");
 			col = 0;
@@ -1444,30 +2584,20 @@ reportIconvCharsets(void)
 			printf("    ");
 			col = 4;
 		    }
-		    printf("%s", allEs[n].locales[t]);
+		    printf("%s", allLs[t].locale);
 		    col += now;
-		    if (t + 1 < allEs[n].length) {
-			printf(", ");
-			col += 2;
-		    }
 		}
 		if (col)
 		    printf("\n");
 	    }
-#ifdef NO_LEAKS
-	    for (n = 0; n < useEs; ++n) {
-		free(allEs[n].encoding);
-		free(allEs[n].locales);
-	    }
-	    free(allEs);
-#endif
 	} else {
 	    Message("No encodings found\n");
 	    rc = EXIT_FAILURE;
 	}
 #ifdef NO_LEAKS
 	for (n = 0; n < useLs; ++n) {
-	    free(allLs[n]);
+	    free(allLs[n].locale);
+	    free(allLs[n].encoding);
 	}
 	free(allLs);
 #endif
@@ -1477,12 +2607,11 @@ reportIconvCharsets(void)
     }
 
     /* cleanup */
-    free(old_locale);
+    free(stamp);
 #endif
     return rc;
 }
 
-#ifdef NO_LEAKS
 /*
  * Given a reverse-pointer, remove all of the corresponding cached information
  * from this module.
@@ -1491,7 +2620,6 @@ void
 luitDestroyReverse(FontMapReversePtr reverse)
 {
     LuitConv *p, *q;
-    size_t n;
 
     for (p = all_conversions, q = 0; p != 0; q = p, p = p->next) {
 	if (&(p->reverse) == reverse) {
@@ -1500,31 +2628,47 @@ luitDestroyReverse(FontMapReversePtr reverse)
 	    if (p->iconv_desc != NO_ICONV)
 		iconv_close(p->iconv_desc);
 
-	    for (n = 0; n < p->table_size; ++n) {
-		if (p->table_utf8[n].text) {
-		    free(p->table_utf8[n].text);
-		}
-	    }
-
 	    /* delink and destroy */
 	    if (q != 0)
 		q->next = p->next;
 	    else
 		all_conversions = p->next;
-	    free(p->table_utf8);
-	    free(p->rev_index);
+	    if (p->shared_addr != 0) {
+		munmap(p->shared_addr, p->shared_size);
+	    } else {
+		free(p->table_utf8);
+		free(p->rev_index);
+	    }
 	    free(p);
 	    break;
 	}
     }
 }
 
+#ifdef NO_LEAKS
 void
 luitconv_leaks(void)
 {
     TRACE(("luitconv_leaks %p\n", (void *) all_conversions));
+    saveIconvNames();
+    if (decode_desc != NO_ICONV) {
+	iconv_close(decode_desc);
+	decode_desc = NO_ICONV;
+    }
+    free(decode_name);
+    decode_name = 0;
     while (all_conversions != 0) {
 	luitDestroyReverse(&(all_conversions->reverse));
     }
+    while (num_names != 0) {
+	--num_names;
+	free(iconv_names[num_names].guess);
+	free(iconv_names[num_names].found);
+    }
+    free(iconv_names);
+    iconv_names = 0;
+    max_names = 0;
+    free(names_stamp);
+    names_stamp = 0;
 }
 #endif
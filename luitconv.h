@@ -29,6 +29,7 @@ THE SOFTWARE.
 
 #include <other.h>
 #include <iconv.h>
+#include <sys/stat.h>
 
 typedef enum {
     umNONE = 0
@@ -72,8 +73,6 @@ typedef struct _FontEnc {
 } FontEncRec, *FontEncPtr;
 
 typedef struct {
-    size_t size;		/* length of text[] */
-    char *text;			/* value, in UTF-8 */
     unsigned ucs;		/* corresponding Unicode value */
 } MappingData;
 
@@ -91,6 +90,10 @@ typedef struct _LuitConv {
     ReverseData *rev_index;	/* reverse-index */
     size_t len_index;		/* index length */
     size_t table_size;		/* length of table_utf8[] and rev_index[] */
+    const unsigned short *const *rev_pages;	/* built-in reverse-mapping */
+    size_t num_pages;		/* length of rev_pages[] */
+    void *shared_addr;		/* tables mapped from a shared file */
+    size_t shared_size;		/* length of the mapping */
     /* data expected by caller */
     FontMapRec mapping;
     FontMapReverseRec reverse;
@@ -105,21 +108,25 @@ typedef struct _BuiltInCharset {
     const char *name;		/* table name, for lookups */
     const BuiltInMapping *table;
     size_t length;		/* length of table[] */
+    const unsigned short *const *pages;	/* reverse-mapping, by Unicode/256 */
+    size_t num_pages;		/* length of pages[] */
 } BuiltInCharsetRec;
 
 extern UM_MODE lookup_order[];
+extern const char *share_dir;
 
 extern FontEncPtr luitGetFontEnc(const char *, UM_MODE);
 extern FontMapPtr luitLookupMapping(const char *, UM_MODE, US_SIZE);
 extern FontMapReversePtr luitLookupReverse(FontMapPtr);
 extern LuitConv *luitLookupEncoding(FontMapPtr);
 extern const BuiltInCharsetRec builtin_encodings[];
+extern const BuiltInCharsetRec builtin_cjk_encodings[];
 extern unsigned luitMapCodeValue(unsigned, FontMapPtr);
+extern unsigned luitDecodeIconv(const char *, unsigned);
 extern void luitFreeFontEnc(FontEncPtr);
-
-#ifdef NO_LEAKS
+extern int openSharedFile(const char *, unsigned long, struct stat *);
+extern void writeSharedFile(const char *, const void *const *, const size_t *, int);
 extern void luitDestroyReverse(FontMapReversePtr);
-#endif
 
 #define LookupMapping(encoding_name,usize) \
 	luitLookupMapping(encoding_name, umANY, usize)
@@ -24,18 +24,167 @@ THE SOFTWARE.
 */
 
 #include <other.h>
+#include <sys.h>
 
 #define EURO_10646 0x20AC
 
+/*
+ * GBK, Big5-HKSCS and the two-byte part of GB18030 use lead-bytes 0x81 to 0xFE
+ * and trail-bytes 0x40 to 0xFE.  Copy their mappings into a table indexed by
+ * lead- and trail-byte, with the reverse-mapping in pages indexed by the
+ * codepoint.  Once those are built, the conversion table is no longer needed.
+ *
+ * The conversion tables hold only the BMP, so the codes which they do not map
+ * (such as those which Big5-HKSCS and GB18030 map into plane 2) are filled in
+ * from iconv.
+ */
+#define DBCS_LEAD_MIN  0x81
+#define DBCS_LEAD_MAX  0xFE
+#define DBCS_TRAIL_MIN 0x40
+#define DBCS_TRAIL_MAX 0xFE
+#define DBCS_LEADS  (DBCS_LEAD_MAX + 1 - DBCS_LEAD_MIN)
+#define DBCS_TRAILS (DBCS_TRAIL_MAX + 1 - DBCS_TRAIL_MIN)
+
+static DbcsTables *gbk_tables;
+static DbcsTables *hkscs_tables;
+static DbcsTables *gb18030_tables;
+
+static int
+dbcs_index(unsigned n)
+{
+    unsigned lead = (n >> 8);
+    unsigned trail = (n & 0xFF);
+    int result = -1;
+
+    if (lead >= DBCS_LEAD_MIN && lead <= DBCS_LEAD_MAX
+	&& trail >= DBCS_TRAIL_MIN && trail <= DBCS_TRAIL_MAX) {
+	result = (int) ((lead - DBCS_LEAD_MIN) * DBCS_TRAILS
+			+ (trail - DBCS_TRAIL_MIN));
+    }
+    return result;
+}
+
+/*
+ * Where several codes map to the same character, the first one is used.
+ */
+static int
+dbcs_reverse(DbcsTables * t, unsigned ucs, unsigned code)
+{
+    UCode *page;
+    int result = 1;
+
+    if ((ucs >> 8) < SizeOf(t->reverse)) {
+	if ((page = t->reverse[ucs >> 8]) == NULL) {
+	    if ((page = TypeCallocN(UCode, 256)) == NULL)
+		result = 0;
+	    t->reverse[ucs >> 8] = page;
+	}
+	if (page != NULL && page[ucs & 0xFF] == 0)
+	    page[ucs & 0xFF] = (UCode) code;
+    }
+    return result;
+}
+
+static void
+dbcs_free(DbcsTables * t)
+{
+    if (t != NULL) {
+	size_t n;
+
+	for (n = 0; n < SizeOf(t->reverse); ++n) {
+	    if (t->reverse[n])
+		free(t->reverse[n]);
+	}
+	free(t->forward);
+	free(t);
+    }
+}
+
+static const DbcsTables *
+dbcs_build(DbcsTables ** cache, const char *name)
+{
+    DbcsTables *t;
+    FontMapPtr mapping;
+
+    if (*cache == NULL
+	&& (mapping = LookupMapping(name, us16BIT)) != NULL
+	&& (t = TypeCalloc(DbcsTables)) != NULL) {
+	unsigned lead, trail;
+	int ok = 1;
+
+	if ((t->forward = TypeCallocN(unsigned, DBCS_LEADS * DBCS_TRAILS)) == NULL)
+	    ok = 0;
+
+	for (lead = DBCS_LEAD_MIN; ok && lead <= DBCS_LEAD_MAX; ++lead) {
+	    for (trail = DBCS_TRAIL_MIN; ok && trail <= DBCS_TRAIL_MAX; ++trail) {
+		unsigned code = (lead << 8) + trail;
+		unsigned ucs = MapCodeValue(code, mapping);
+		if (ucs != code && ucs != 0) {
+		    t->forward[dbcs_index(code)] = ucs;
+		    ok = dbcs_reverse(t, ucs, code);
+		}
+	    }
+	}
+#ifdef USE_ICONV
+	/* fill the gaps after the table, so the reverse prefers its codes */
+	for (lead = DBCS_LEAD_MIN; ok && lead <= DBCS_LEAD_MAX; ++lead) {
+	    for (trail = DBCS_TRAIL_MIN; ok && trail <= DBCS_TRAIL_MAX; ++trail) {
+		unsigned code = (lead << 8) + trail;
+		unsigned ucs;
+		if (t->forward[dbcs_index(code)] == 0
+		    && (ucs = luitDecodeIconv(name, code)) != 0) {
+		    t->forward[dbcs_index(code)] = ucs;
+		    ok = dbcs_reverse(t, ucs, code);
+		}
+	    }
+	}
+#endif
+#ifdef USE_ICONV
+	luitDestroyReverse(LookupReverse(mapping));
+#endif
+	if (ok) {
+	    *cache = t;
+	} else {
+	    dbcs_free(t);
+	}
+	TRACE(("dbcs_build(%s) %s\n", name, ok ? "done" : "failed"));
+    }
+    return *cache;
+}
+
+/*
+ * Unlike MapCodeValue, return zero if there is no mapping, so that the code
+ * is dropped rather than shown as an unrelated character.
+ */
+static unsigned
+dbcs_lookup(const DbcsTables * t, unsigned n)
+{
+    int index = dbcs_index(n);
+    unsigned result = 0;
+
+    if (index >= 0 && t->forward[index] != 0)
+	result = t->forward[index];
+    return result;
+}
+
+static unsigned
+dbcs_lookup_reverse(const DbcsTables * t, unsigned n)
+{
+    const UCode *page;
+    unsigned result = n;
+
+    if ((n >> 8) < SizeOf(t->reverse)
+	&& (page = t->reverse[n >> 8]) != NULL
+	&& page[n & 0xFF] != 0)
+	result = page[n & 0xFF];
+    return result;
+}
+
 int
 init_gbk(OtherStatePtr s)
 {
-    s->gbk.mapping = LookupMapping("gbk-0", us16BIT);
-    if (!s->gbk.mapping)
-	return 0;
-
-    s->gbk.reverse = LookupReverse(s->gbk.mapping);
-    if (!s->gbk.reverse)
+    s->gbk.tables = dbcs_build(&gbk_tables, "gbk-0");
+    if (!s->gbk.tables)
 	return 0;
 
     s->gbk.buf = -1;
@@ -45,13 +194,11 @@ init_gbk(OtherStatePtr s)
 unsigned int
 mapping_gbk(unsigned int n, OtherStatePtr s)
 {
-    unsigned int r;
     if (n < 128)
 	return n;
     if (n == 128)
 	return EURO_10646;
-    r = MapCodeValue(n, s->gbk.mapping);
-    return r;
+    return dbcs_lookup(s->gbk.tables, n);
 }
 
 unsigned int
@@ -61,7 +208,7 @@ reverse_gbk(unsigned int n, OtherStatePtr s)
 	return n;
     if (n == EURO_10646)
 	return 128;
-    return s->gbk.reverse->reverse(n, s->gbk.reverse->data);
+    return dbcs_lookup_reverse(s->gbk.tables, n);
 }
 
 int
@@ -175,12 +322,235 @@ stack_utf8(unsigned c, OtherStatePtr s)
     return -1;
 }
 
-#define HALFWIDTH_10646 0xFF61
 #define YEN_SJIS 0x5C
 #define YEN_10646 0x00A5
 #define OVERLINE_SJIS 0x7E
 #define OVERLINE_10646 0x203E
 
+/*
+ * Shift_JIS lead-bytes are 0x81 to 0x9F and 0xE0 to 0xFC, trail-bytes 0x40 to
+ * 0xFC.  Rather than converting each pair to JIS X 0208 and looking that up,
+ * build a table indexed by the pair, and a page-table for the reverse.  Lead
+ * bytes past 0xEF are not part of JIS X 0208, but are used for the NEC/IBM
+ * extensions and user-defined characters of CP932.
+ */
+#define SJIS_TRAIL_MIN 0x40
+#define SJIS_TRAIL_MAX 0xFC
+#define SJIS_TRAILS (SJIS_TRAIL_MAX + 1 - SJIS_TRAIL_MIN)
+#define SJIS_LEADS  ((0x9F + 1 - 0x81) + (0xFC + 1 - 0xE0))
+
+static SjisTables *sjis_tables;
+
+static int
+sjis_index(unsigned n)
+{
+    unsigned lead = (n >> 8) & 0xFF;
+    unsigned trail = n & 0xFF;
+    int result = -1;
+
+    if (n <= 0xFFFF && trail >= SJIS_TRAIL_MIN && trail <= SJIS_TRAIL_MAX) {
+	if (lead >= 0x81 && lead <= 0x9F) {
+	    result = (int) (lead - 0x81);
+	} else if (lead >= 0xE0 && lead <= 0xFC) {
+	    result = (int) (lead - 0xE0 + (0x9F + 1 - 0x81));
+	}
+	if (result >= 0)
+	    result = result * SJIS_TRAILS + (int) (trail - SJIS_TRAIL_MIN);
+    }
+    return result;
+}
+
+static unsigned
+sjis_to_jis(unsigned n)
+{
+    unsigned j1, j2, s1, s2;
+
+    s1 = ((n >> 8) & 0xFF);
+    s2 = (n & 0xFF);
+    j1 = (s1 << 1)
+	- (unsigned) (s1 <= 0x9F ? 0xE0 : 0x160)
+	- (unsigned) (s2 < 0x9F ? 1 : 0);
+    j2 = s2
+	- 0x1F
+	- (unsigned) (s2 >= 0x7F ? 1 : 0)
+	- (unsigned) (s2 >= 0x9F ? 0x5E : 0);
+    return (j1 << 8) + j2;
+}
+
+/*
+ * Depending on the configuration, a missing mapping may give zero or the code
+ * itself.
+ */
+static unsigned
+sjis_lookup(unsigned code, FontMapPtr mapping)
+{
+    unsigned result = MapCodeValue(code, mapping);
+    if (result == code || result > 0xFFFF)
+	result = 0;
+    return result;
+}
+
+static void
+sjis_reverse(SjisTables * t, unsigned ucs, unsigned code)
+{
+    UCode *page;
+
+    if (ucs == 0 || ucs > 0xFFFF)
+	return;
+    if ((page = t->reverse[ucs >> 8]) == NULL) {
+	if ((page = TypeCallocN(UCode, 256)) == NULL)
+	    return;
+	t->reverse[ucs >> 8] = page;
+    }
+    if (page[ucs & 0xFF] == 0)
+	page[ucs & 0xFF] = (UCode) code;
+}
+
+static void
+sjis_reverse_rows(SjisTables * t, int ibm)
+{
+    unsigned lead, trail;
+
+    for (lead = 0x81; lead <= 0xFC; ++lead) {
+	if (ibm != (lead == 0xED || lead == 0xEE))
+	    continue;
+	for (trail = SJIS_TRAIL_MIN; trail <= SJIS_TRAIL_MAX; ++trail) {
+	    unsigned code = (lead << 8) + trail;
+	    int n = sjis_index(code);
+	    if (n >= 0)
+		sjis_reverse(t, t->forward[n], code);
+	}
+    }
+}
+
+static unsigned
+sjis_next(unsigned code)
+{
+    if ((code & 0xFF) == SJIS_TRAIL_MAX)
+	code += 0x100 - (SJIS_TRAIL_MAX - SJIS_TRAIL_MIN);
+    else if ((code & 0xFF) == 0x7E)
+	code += 2;
+    else
+	code += 1;
+    return code;
+}
+
+/*
+ * iconv gives only one code for each character, but CP932 encodes some twice:
+ * the NEC-selected IBM extensions repeat the IBM extensions, which in turn
+ * repeat some of the NEC row 13 symbols, and a few of those are also in JIS X
+ * 0208.  Fill the repeats in that order.
+ */
+static void
+sjis_duplicates(SjisTables * t)
+{
+    /* *INDENT-OFF* */
+    static const struct {
+	unsigned short code;
+	unsigned short count;
+	unsigned short same;
+    } table[] = {
+	{ 0x8790,   1, 0x81E0 },
+	{ 0x8791,   1, 0x81DF },
+	{ 0x8792,   1, 0x81E7 },
+	{ 0x8795,   1, 0x81E3 },
+	{ 0x8796,   1, 0x81DB },
+	{ 0x8797,   1, 0x81DA },
+	{ 0x879A,   1, 0x81E6 },
+	{ 0x879B,   1, 0x81BF },
+	{ 0x879C,   1, 0x81BE },
+	{ 0xFA4A,  10, 0x8754 },
+	{ 0xFA54,   1, 0x81CA },
+	{ 0xFA58,   1, 0x878A },
+	{ 0xFA59,   1, 0x8782 },
+	{ 0xFA5A,   1, 0x8784 },
+	{ 0xFA5B,   1, 0x81E6 },
+	{ 0xED40, 360, 0xFA5C },
+	{ 0xEEEF,  10, 0xFA40 },
+	{ 0xEEF9,   4, 0xFA54 },
+    };
+    /* *INDENT-ON* */
+    size_t n;
+
+    for (n = 0; n < SizeOf(table); ++n) {
+	unsigned code = table[n].code;
+	unsigned same = table[n].same;
+	unsigned k;
+
+	for (k = 0; k < table[n].count; ++k) {
+	    int dst = sjis_index(code);
+	    int src = sjis_index(same);
+
+	    if (dst >= 0 && src >= 0 && t->forward[dst] == 0)
+		t->forward[dst] = t->forward[src];
+	    code = sjis_next(code);
+	    same = sjis_next(same);
+	}
+    }
+}
+
+static SjisTables *
+sjis_build(OtherStatePtr s)
+{
+    SjisTables *t;
+    unsigned code;
+    unsigned ucs;
+
+    if ((t = TypeCalloc(SjisTables)) == NULL)
+	return NULL;
+    if ((t->forward = TypeCallocN(UCode, SJIS_LEADS * SJIS_TRAILS)) == NULL) {
+	free(t);
+	return NULL;
+    }
+
+    for (code = 0xA0; code <= 0xDF; ++code) {
+	t->kana[code - 0xA0] = (UCode) sjis_lookup(code, s->sjis.x0201mapping);
+    }
+
+    for (code = 0x8140; code <= 0xFCFC; ++code) {
+	int n = sjis_index(code);
+	unsigned jis;
+
+	if (n < 0 || (code & 0xFF) == 0x7F)
+	    continue;
+	jis = sjis_to_jis(code);
+	if ((jis >> 8) >= 0x21 && (jis >> 8) <= 0x7E
+	    && (jis & 0xFF) >= 0x21 && (jis & 0xFF) <= 0x7E) {
+	    t->forward[n] = (UCode) sjis_lookup(jis, s->sjis.x0208mapping);
+	}
+	if (t->forward[n] == 0 && s->sjis.cp932mapping != NULL) {
+	    t->forward[n] = (UCode) sjis_lookup(code, s->sjis.cp932mapping);
+	}
+    }
+
+    if (s->sjis.cp932mapping != NULL)
+	sjis_duplicates(t);
+
+    /*
+     * For the repeated characters, prefer the IBM extensions over the
+     * NEC-selected rows (0xED and 0xEE) as Windows does.
+     */
+    sjis_reverse_rows(t, 0);
+    sjis_reverse_rows(t, 1);
+
+    /* accept the CP932 variants of JIS X 0208 characters as input */
+    if (s->sjis.cp932mapping != NULL) {
+	for (code = 0x8140; code <= 0x84FC; ++code) {
+	    if (sjis_index(code) >= 0
+		&& (ucs = sjis_lookup(code, s->sjis.cp932mapping)) != 0)
+		sjis_reverse(t, ucs, code);
+	}
+    }
+
+    for (code = 0xA0; code <= 0xDF; ++code) {
+	sjis_reverse(t, t->kana[code - 0xA0], code);
+    }
+
+    TRACE(("sjis_build: %s CP932 extensions\n",
+	   s->sjis.cp932mapping ? "with" : "without"));
+    return t;
+}
+
 int
 init_sjis(OtherStatePtr s)
 {
@@ -188,17 +558,23 @@ init_sjis(OtherStatePtr s)
     if (!s->sjis.x0208mapping)
 	return 0;
 
-    s->sjis.x0208reverse = LookupReverse(s->sjis.x0208mapping);
-    if (!s->sjis.x0208reverse)
-	return 0;
-
     s->sjis.x0201mapping = LookupMapping("jisx0201.1976-0", us16BIT);
     if (!s->sjis.x0201mapping)
 	return 0;
 
-    s->sjis.x0201reverse = LookupReverse(s->sjis.x0201mapping);
-    if (!s->sjis.x0201reverse)
+    /*
+     * The vendor extensions are optional.  Check for the circled digit one,
+     * since a failed lookup may give a placeholder with only ASCII.
+     */
+    s->sjis.cp932mapping = LookupMapping("CP932", us16BIT);
+    if (s->sjis.cp932mapping != NULL
+	&& sjis_lookup(0x8740, s->sjis.cp932mapping) != 0x2460)
+	s->sjis.cp932mapping = NULL;
+
+    if (sjis_tables == NULL
+	&& (sjis_tables = sjis_build(s)) == NULL)
 	return 0;
+    s->sjis.tables = sjis_tables;
 
     s->sjis.buf = -1;
     return 1;
@@ -207,47 +583,35 @@ init_sjis(OtherStatePtr s)
 unsigned int
 mapping_sjis(unsigned int n, OtherStatePtr s)
 {
-    unsigned int j1, j2, s1, s2;
+    int index;
+
     if (n == YEN_SJIS)
 	return YEN_10646;
     if (n == OVERLINE_SJIS)
 	return OVERLINE_10646;
     if (n < 0x80)
 	return n;
-    if (n >= 0xA0 && n <= 0xDF)
-	return MapCodeValue(n, s->sjis.x0201mapping);
-    s1 = ((n >> 8) & 0xFF);
-    s2 = (n & 0xFF);
-    j1 = (s1 << 1)
-	- (unsigned) (s1 <= 0x9F ? 0xE0 : 0x160)
-	- (unsigned) (s2 < 0x9F ? 1 : 0);
-    j2 = s2
-	- 0x1F
-	- (unsigned) (s2 >= 0x7F ? 1 : 0)
-	- (unsigned) (s2 >= 0x9F ? 0x5E : 0);
-    return MapCodeValue((j1 << 8) + j2, s->sjis.x0208mapping);
+    if (n >= 0xA0 && n <= 0xDF && s->sjis.tables->kana[n - 0xA0] != 0)
+	return s->sjis.tables->kana[n - 0xA0];
+    if ((index = sjis_index(n)) >= 0 && s->sjis.tables->forward[index] != 0)
+	return s->sjis.tables->forward[index];
+    return n;
 }
 
 unsigned int
 reverse_sjis(unsigned int n, OtherStatePtr s)
 {
-    unsigned int j, j1, j2, s1, s2;
+    const UCode *page;
+
     if (n == YEN_10646)
 	return YEN_SJIS;
     if (n == OVERLINE_10646)
 	return OVERLINE_SJIS;
     if (n < 0x80)
 	return n;
-    if (n >= HALFWIDTH_10646)
-	return s->sjis.x0201reverse->reverse(n, s->sjis.x0201reverse->data);
-    j = s->sjis.x0208reverse->reverse(n, s->sjis.x0208reverse->data);
-    j1 = ((j >> 8) & 0xFF);
-    j2 = (j & 0xFF);
-    s1 = ((j1 - 1) >> 1)
-	+ (unsigned) ((j1 <= 0x5E) ? 0x71 : 0xB1);
-    s2 = j2
-	+ (unsigned) ((j1 & 1) ? ((j2 < 0x60) ? 0x1F : 0x20) : 0x7E);
-    return (s1 << 8) + s2;
+    if (n <= 0xFFFF && (page = s->sjis.tables->reverse[n >> 8]) != NULL)
+	return page[n & 0xFF];
+    return 0;
 }
 
 int
@@ -276,12 +640,8 @@ stack_sjis(unsigned c, OtherStatePtr s)
 int
 init_hkscs(OtherStatePtr s)
 {
-    s->hkscs.mapping = LookupMapping("big5hkscs-0", us16BIT);
-    if (!s->hkscs.mapping)
-	return 0;
-
-    s->hkscs.reverse = LookupReverse(s->hkscs.mapping);
-    if (!s->hkscs.reverse)
+    s->hkscs.tables = dbcs_build(&hkscs_tables, "big5hkscs-0");
+    if (!s->hkscs.tables)
 	return 0;
 
     s->hkscs.buf = -1;
@@ -291,13 +651,11 @@ init_hkscs(OtherStatePtr s)
 unsigned int
 mapping_hkscs(unsigned int n, OtherStatePtr s)
 {
-    unsigned int r;
     if (n < 128)
 	return n;
     if (n == 128)
 	return EURO_10646;
-    r = MapCodeValue(n, s->hkscs.mapping);
-    return r;
+    return dbcs_lookup(s->hkscs.tables, n);
 }
 
 unsigned int
@@ -307,7 +665,7 @@ reverse_hkscs(unsigned int n, OtherStatePtr s)
 	return n;
     if (n == EURO_10646)
 	return 128;
-    return s->hkscs.reverse->reverse(n, s->hkscs.reverse->data);
+    return dbcs_lookup_reverse(s->hkscs.tables, n);
 }
 
 int
@@ -337,10 +695,8 @@ stack_hkscs(unsigned c, OtherStatePtr s)
  *  Because of the 1 ~ 4 multi-bytes nature of GB18030.
  *  CharSet encoding is split to 2 subset (besides latin)
  *  The 2Bytes MB char is defined in gb18030.2000-0
- *  The 4Bytes MB char is defined in gb18030.2000-1
- *  Please note that the mapping in 2000-1 is not a 4Bytes seq => 2Bytes value
- *  mapping.
- *  To use the 2000-1 we need to 'linear' the 4Bytes sequence and 'lookup' the 
+ *  The 4Bytes MB char is computed from a table of ranges (see below).
+ *  To use the table we need to 'linear' the 4Bytes sequence and 'lookup' the
  *  unicode value after that.
  *
  *  For more info on GB18030 standard pls check:
@@ -349,23 +705,149 @@ stack_hkscs(unsigned c, OtherStatePtr s)
  *  For more info on GB18030 implementation issues in XFree86 pls check:
  *    http://www.ibm.com/developerWorks/cn/linux/i18n/gb18030/xfree86/part1
  */
-int
-init_gb18030(OtherStatePtr s)
-{
-    s->gb18030.cs0_mapping = LookupMapping("gb18030.2000-0", us16BIT);
-    if (!s->gb18030.cs0_mapping)
-	return 0;
 
-    s->gb18030.cs0_reverse = LookupReverse(s->gb18030.cs0_mapping);
-    if (!s->gb18030.cs0_reverse)
-	return 0;
+/*
+ * The four-byte sequences for the BMP (0x81308130 to 0x8431A439) are numbered
+ * in the same order as the codepoints which they encode, skipping those which
+ * have a two-byte sequence.  That gives a short list of ranges in which the
+ * linear index and the codepoint increase together.  Each entry gives the
+ * first index and codepoint of a range, which ends where the next one starts.
+ *
+ * GB18030-2005 moved U+E7C7 to 0x8135F437, which GB18030-2000 gave to U+1E3F,
+ * now 0xA8BC.  The four-byte sequences from 0x90308130 encode the
+ * supplementary planes in order.
+ */
+#define GB18030_BMP_LIMIT  39420	/* after 0x8431A439 */
+#define GB18030_SUPP_FIRST 189000	/* 0x90308130 */
+#define GB18030_E7C7       7457		/* 0x8135F437 */
 
-    s->gb18030.cs1_mapping = LookupMapping("gb18030.2000-1", us16BIT);
-    if (!s->gb18030.cs1_mapping)
-	return 0;
+typedef struct {
+    unsigned short linear;
+    unsigned short ucs;
+} GB18030_RANGE;
+
+/* *INDENT-OFF* */
+static const GB18030_RANGE gb18030_ranges[] =
+{
+    {0x0000, 0x0080}, {0x0024, 0x00A5}, {0x0026, 0x00A9}, {0x002D, 0x00B2},
+    {0x0032, 0x00B8}, {0x0051, 0x00D8}, {0x0059, 0x00E2}, {0x005F, 0x00EB},
+    {0x0060, 0x00EE}, {0x0064, 0x00F4}, {0x0067, 0x00F8}, {0x0068, 0x00FB},
+    {0x0069, 0x00FD}, {0x006D, 0x0102}, {0x007E, 0x0114}, {0x0085, 0x011C},
+    {0x0094, 0x012C}, {0x00AC, 0x0145}, {0x00AF, 0x0149}, {0x00B3, 0x014E},
+    {0x00D0, 0x016C}, {0x0132, 0x01CF}, {0x0133, 0x01D1}, {0x0134, 0x01D3},
+    {0x0135, 0x01D5}, {0x0136, 0x01D7}, {0x0137, 0x01D9}, {0x0138, 0x01DB},
+    {0x0139, 0x01DD}, {0x0155, 0x01FA}, {0x01AC, 0x0252}, {0x01BB, 0x0262},
+    {0x0220, 0x02C8}, {0x0221, 0x02CC}, {0x022E, 0x02DA}, {0x02E5, 0x03A2},
+    {0x02E6, 0x03AA}, {0x02ED, 0x03C2}, {0x02EE, 0x03CA}, {0x0325, 0x0402},
+    {0x0333, 0x0450}, {0x0334, 0x0452}, {0x1EF2, 0x2011}, {0x1EF4, 0x2017},
+    {0x1EF5, 0x201A}, {0x1EF7, 0x201E}, {0x1EFE, 0x2027}, {0x1F07, 0x2031},
+    {0x1F08, 0x2034}, {0x1F09, 0x2036}, {0x1F0E, 0x203C}, {0x1F7E, 0x20AD},
+    {0x1FD4, 0x2104}, {0x1FD5, 0x2106}, {0x1FD8, 0x210A}, {0x1FE4, 0x2117},
+    {0x1FEE, 0x2122}, {0x202C, 0x216C}, {0x2030, 0x217A}, {0x2046, 0x2194},
+    {0x2048, 0x219A}, {0x20B6, 0x2209}, {0x20BC, 0x2210}, {0x20BD, 0x2212},
+    {0x20C0, 0x2216}, {0x20C4, 0x221B}, {0x20C6, 0x2221}, {0x20C8, 0x2224},
+    {0x20C9, 0x2226}, {0x20CA, 0x222C}, {0x20CC, 0x222F}, {0x20D1, 0x2238},
+    {0x20D6, 0x223E}, {0x20E0, 0x2249}, {0x20E3, 0x224D}, {0x20E8, 0x2253},
+    {0x20F5, 0x2262}, {0x20F7, 0x2268}, {0x20FD, 0x2270}, {0x2122, 0x2296},
+    {0x2125, 0x229A}, {0x2130, 0x22A6}, {0x2149, 0x22C0}, {0x219B, 0x2313},
+    {0x22E8, 0x246A}, {0x22F2, 0x249C}, {0x2356, 0x254C}, {0x235A, 0x2574},
+    {0x2367, 0x2590}, {0x236A, 0x2596}, {0x2374, 0x25A2}, {0x2384, 0x25B4},
+    {0x238C, 0x25BE}, {0x2394, 0x25C8}, {0x2397, 0x25CC}, {0x2399, 0x25D0},
+    {0x23AB, 0x25E6}, {0x23CA, 0x2607}, {0x23CC, 0x260A}, {0x2402, 0x2641},
+    {0x2403, 0x2643}, {0x2C41, 0x2E82}, {0x2C43, 0x2E85}, {0x2C46, 0x2E89},
+    {0x2C48, 0x2E8D}, {0x2C52, 0x2E98}, {0x2C61, 0x2EA8}, {0x2C63, 0x2EAB},
+    {0x2C66, 0x2EAF}, {0x2C6A, 0x2EB4}, {0x2C6C, 0x2EB8}, {0x2C6F, 0x2EBC},
+    {0x2C7D, 0x2ECB}, {0x2DA2, 0x2FFC}, {0x2DA6, 0x3004}, {0x2DA7, 0x3018},
+    {0x2DAC, 0x301F}, {0x2DAE, 0x302A}, {0x2DC2, 0x303F}, {0x2DC4, 0x3094},
+    {0x2DCB, 0x309F}, {0x2DCD, 0x30F7}, {0x2DD2, 0x30FF}, {0x2DD8, 0x312A},
+    {0x2ECE, 0x322A}, {0x2ED5, 0x3232}, {0x2F46, 0x32A4}, {0x3030, 0x3390},
+    {0x303C, 0x339F}, {0x303E, 0x33A2}, {0x3060, 0x33C5}, {0x3069, 0x33CF},
+    {0x306B, 0x33D3}, {0x306D, 0x33D6}, {0x30DE, 0x3448}, {0x3109, 0x3474},
+    {0x3233, 0x359F}, {0x32A2, 0x360F}, {0x32AD, 0x361B}, {0x35AA, 0x3919},
+    {0x35FF, 0x396F}, {0x365F, 0x39D1}, {0x366D, 0x39E0}, {0x3700, 0x3A74},
+    {0x37DA, 0x3B4F}, {0x38F9, 0x3C6F}, {0x396A, 0x3CE1}, {0x3CDF, 0x4057},
+    {0x3DE7, 0x4160}, {0x3FBE, 0x4338}, {0x4032, 0x43AD}, {0x4036, 0x43B2},
+    {0x4061, 0x43DE}, {0x4159, 0x44D7}, {0x42CE, 0x464D}, {0x42E2, 0x4662},
+    {0x43A3, 0x4724}, {0x43A8, 0x472A}, {0x43FA, 0x477D}, {0x440A, 0x478E},
+    {0x45C3, 0x4948}, {0x45F5, 0x497B}, {0x45F7, 0x497E}, {0x45FB, 0x4984},
+    {0x45FC, 0x4987}, {0x4610, 0x499C}, {0x4613, 0x49A0}, {0x4629, 0x49B8},
+    {0x48E8, 0x4C78}, {0x490F, 0x4CA4}, {0x497E, 0x4D1A}, {0x4A12, 0x4DAF},
+    {0x4A63, 0x9FA6}, {0x82BD, 0xE76C}, {0x82BE, 0xE7C8}, {0x82BF, 0xE7E7},
+    {0x82CC, 0xE815}, {0x82CD, 0xE819}, {0x82D2, 0xE81F}, {0x82D9, 0xE827},
+    {0x82DD, 0xE82D}, {0x82E1, 0xE833}, {0x82E9, 0xE83C}, {0x82F0, 0xE844},
+    {0x8300, 0xE856}, {0x830E, 0xE865}, {0x93D5, 0xF92D}, {0x9421, 0xF97A},
+    {0x943C, 0xF996}, {0x948D, 0xF9E8}, {0x9496, 0xF9F2}, {0x94B0, 0xFA10},
+    {0x94B1, 0xFA12}, {0x94B2, 0xFA15}, {0x94B5, 0xFA19}, {0x94BB, 0xFA22},
+    {0x94BC, 0xFA25}, {0x94BE, 0xFA2A}, {0x98C4, 0xFE32}, {0x98C5, 0xFE45},
+    {0x98C9, 0xFE53}, {0x98CA, 0xFE58}, {0x98CB, 0xFE67}, {0x98CC, 0xFE6C},
+    {0x9961, 0xFF5F}, {0x99E2, 0xFFE6},
+};
+/* *INDENT-ON* */
+
+static unsigned
+gb18030_to_ucs(unsigned linear)
+{
+    unsigned result = 0;
+
+    if (linear == GB18030_E7C7) {
+	result = 0xE7C7;
+    } else if (linear < GB18030_BMP_LIMIT) {
+	size_t lo = 0;
+	size_t hi = SizeOf(gb18030_ranges);
+
+	while (hi - lo > 1) {
+	    size_t mid = (lo + hi) / 2;
+	    if (gb18030_ranges[mid].linear <= linear)
+		lo = mid;
+	    else
+		hi = mid;
+	}
+	result = gb18030_ranges[lo].ucs + (linear - gb18030_ranges[lo].linear);
+    } else if (linear >= GB18030_SUPP_FIRST
+	       && linear - GB18030_SUPP_FIRST < 0x100000) {
+	result = 0x10000 + (linear - GB18030_SUPP_FIRST);
+    }
+    return result;
+}
+
+static int
+gb18030_to_linear(unsigned ucs)
+{
+    int result = -1;
+
+    if (ucs == 0xE7C7) {
+	result = GB18030_E7C7;
+    } else if (ucs == 0x1E3F) {
+	;			/* 0xA8BC, from the two-byte table */
+    } else if (ucs >= 0x10000 && ucs <= 0x10FFFF) {
+	result = (int) (GB18030_SUPP_FIRST + (ucs - 0x10000));
+    } else if (ucs >= gb18030_ranges[0].ucs && ucs <= 0xFFFF) {
+	size_t lo = 0;
+	size_t hi = SizeOf(gb18030_ranges);
+	unsigned limit;
+
+	while (hi - lo > 1) {
+	    size_t mid = (lo + hi) / 2;
+	    if (gb18030_ranges[mid].ucs <= ucs)
+		lo = mid;
+	    else
+		hi = mid;
+	}
+	limit = ((lo + 1 < SizeOf(gb18030_ranges))
+		 ? gb18030_ranges[lo + 1].linear
+		 : GB18030_BMP_LIMIT);
+	if (ucs - gb18030_ranges[lo].ucs < limit - gb18030_ranges[lo].linear)
+	    result = (int) (gb18030_ranges[lo].linear
+			    + (ucs - gb18030_ranges[lo].ucs));
+    }
+    return result;
+}
 
-    s->gb18030.cs1_reverse = LookupReverse(s->gb18030.cs1_mapping);
-    if (!s->gb18030.cs1_reverse)
+int
+init_gb18030(OtherStatePtr s)
+{
+    s->gb18030.cs0_tables = dbcs_build(&gb18030_tables, "gb18030.2000-0");
+    if (!s->gb18030.cs0_tables)
 	return 0;
 
     s->gb18030.linear = 0;
@@ -376,34 +858,39 @@ init_gb18030(OtherStatePtr s)
 unsigned int
 mapping_gb18030(unsigned int n, OtherStatePtr s)
 {
+    if (s->gb18030.linear) {
+	unsigned ucs = gb18030_to_ucs(n);
+	return (ucs != 0) ? ucs : '?';
+    }
     if (n <= 0x80)
 	return n;		/* 0x80 is valid but unassigned codepoint */
     if (n >= 0xFFFF)
 	return '?';
 
-    return MapCodeValue(n,
-			((s->gb18030.linear)
-			 ? s->gb18030.cs1_mapping
-			 : s->gb18030.cs0_mapping));
+    return dbcs_lookup(s->gb18030.cs0_tables, n);
 }
 
 unsigned int
 reverse_gb18030(unsigned int n, OtherStatePtr s)
 {
-    /* when lookup in 2000-0 failed. */
-    /* lookup in 2000-1 and then try to unlinear'd */
+    /*
+     * The four-byte ranges are disjoint from 2000-0, and unlike its reverse
+     * lookup, tell us when there is no match.
+     */
     unsigned int r;
-    if (n <= 0x80)
-	return n;
+    int linear;
 
-    r = s->gb18030.cs0_reverse->reverse(n, s->gb18030.cs0_reverse->data);
-    if (r != 0)
-	return r;
+    if (n < 0x80)
+	return n;
 
-    r = s->gb18030.cs1_reverse->reverse(n, s->gb18030.cs1_reverse->data);
-    if (r != 0) {
+    linear = gb18030_to_linear(n);
+    if (linear < 0) {
+	r = dbcs_lookup_reverse(s->gb18030.cs0_tables, n);
+    } else {
 	unsigned char bytes[4];
 
+	r = (unsigned) linear;
+
 	bytes[3] = UChar(0x30 + r % 10);
 	r /= 10;
 	bytes[2] = UChar(0x81 + r % 126);
@@ -424,22 +911,22 @@ int
 stack_gb18030(unsigned c, OtherStatePtr s)
 {
     /* if set gb18030.linear => True. the return value is "linear'd" */
+    s->gb18030.linear = 0;
     if (s->gb18030.buf_ptr == 0) {
 	if (c <= 0x80)
 	    return (int) c;
 	if (c == 0xFF)
 	    return -1;
-	s->gb18030.linear = 0;
 	s->gb18030.buf[s->gb18030.buf_ptr++] = (int) c;
 	return -1;
     } else if (s->gb18030.buf_ptr == 1) {
 	if (c >= 0x40) {
 	    s->gb18030.buf_ptr = 0;
-	    if ((c == 0x80) || (c == 0xFF))
+	    if ((c == 0x7F) || (c == 0xFF))
 		return -1;
 	    else
 		return (int) ((unsigned) (s->gb18030.buf[0] << 8) + c);
-	} else if (c >= 30) {	/* 2Byte is (0x30 -> 0x39) */
+	} else if (c >= 0x30 && c <= 0x39) {	/* 2Byte is (0x30 -> 0x39) */
 	    s->gb18030.buf[s->gb18030.buf_ptr++] = (int) c;
 	    return -1;
 	} else {
@@ -468,3 +955,27 @@ stack_gb18030(unsigned c, OtherStatePtr s)
 	return -1;
     }
 }
+
+#ifdef NO_LEAKS
+void
+other_leaks(void)
+{
+    dbcs_free(gbk_tables);
+    gbk_tables = NULL;
+    dbcs_free(hkscs_tables);
+    hkscs_tables = NULL;
+    dbcs_free(gb18030_tables);
+    gb18030_tables = NULL;
+
+    if (sjis_tables != NULL) {
+	int n;
+	for (n = 0; n < 256; ++n) {
+	    if (sjis_tables->reverse[n])
+		free(sjis_tables->reverse[n]);
+	}
+	free(sjis_tables->forward);
+	free(sjis_tables);
+	sjis_tables = NULL;
+    }
+}
+#endif
@@ -39,8 +39,12 @@ THE SOFTWARE.
 #define UChar(n) ((UCHAR)(n))
 
 typedef struct {
-    FontMapPtr mapping;
-    FontMapReversePtr reverse;
+    unsigned *forward;		/* lead-byte x trail-byte */
+    UCode *reverse[0x300];	/* pages, by the codepoint / 256, planes 0-2 */
+} DbcsTables;
+
+typedef struct {
+    const DbcsTables *tables;
     int buf;
 } aux_gbk;
 
@@ -49,26 +53,27 @@ typedef struct {
     int buf_ptr, len;
 } aux_utf8;
 
+typedef struct {
+    UCode *forward;		/* lead-byte x trail-byte */
+    UCode kana[0x40];		/* half-width katakana 0xA0 to 0xDF */
+    UCode *reverse[256];	/* pages, by the high-byte of the codepoint */
+} SjisTables;
+
 typedef struct {
     FontMapPtr x0208mapping;
     FontMapPtr x0201mapping;
-    FontMapReversePtr x0208reverse;
-    FontMapReversePtr x0201reverse;
+    FontMapPtr cp932mapping;	/* optional, for the vendor extensions */
+    SjisTables *tables;
     int buf;
 } aux_sjis;
 
 typedef struct {
-    FontMapPtr mapping;
-    FontMapReversePtr reverse;
+    const DbcsTables *tables;
     int buf;
 } aux_hkscs;
 
 typedef struct {
-    FontMapPtr cs0_mapping;	/* gb18030.2000-0 */
-    FontMapReversePtr cs0_reverse;
-
-    FontMapPtr cs1_mapping;	/* gb18030.2000-1 */
-    FontMapReversePtr cs1_reverse;
+    const DbcsTables *cs0_tables;	/* gb18030.2000-0 */
 
     int linear;			/* set to '1' if stack_gb18030 linearized a 4bytes seq */
     int buf[3];
@@ -144,8 +144,39 @@ waitForOutput(int fd)
     return ret;
 }
 
+#if defined(HAVE_WORKING_POLL)
+static short
+pollEvents(int wanted, int input, int output)
+{
+    return (short) (((wanted & input) ? POLLIN : 0)
+		    | ((wanted & output) ? POLLOUT : 0));
+}
+
+static int
+pollResult(int revents, int wanted, int input, int output)
+{
+    int result = 0;
+
+    if (revents & POLLNVAL)
+	result |= IO_Closed;
+    if (revents & (POLLERR | POLLHUP))
+	result |= (wanted & input) ? input : (wanted & output);
+    if ((revents & POLLIN) && (wanted & input))
+	result |= input;
+    if ((revents & POLLOUT) && (wanted & output))
+	result |= output;
+    return result;
+}
+#endif
+
+/*
+ * Wait until one of the wanted conditions holds, for at most the given number
+ * of milliseconds (forever if negative).  IO_CanRead and IO_CanWrite ask for
+ * input on fd1 and fd2 respectively, while IO_Output1 and IO_Output2 ask for
+ * fd1 or fd2 to accept output.  Returns zero on timeout.
+ */
 int
-waitForInput(int fd1, int fd2)
+waitForIO(int fd1, int fd2, int wanted, int timeout)
 {
     int ret = 0;
 
@@ -155,43 +186,58 @@ waitForInput(int fd1, int fd2)
 
     pfd[0].fd = fd1;
     pfd[1].fd = fd2;
-    pfd[0].events = pfd[1].events = POLLIN;
+    pfd[0].events = pollEvents(wanted, IO_CanRead, IO_Output1);
+    pfd[1].events = pollEvents(wanted, IO_CanWrite, IO_Output2);
     pfd[0].revents = pfd[1].revents = 0;
+    if (pfd[0].events == 0)
+	pfd[0].fd = -1;
+    if (pfd[1].events == 0)
+	pfd[1].fd = -1;
 
-    rc = poll(pfd, (nfds_t) 2, -1);
+    rc = poll(pfd, (nfds_t) 2, timeout);
     if (rc < 0) {
 	ret = -1;
     } else {
-	if (pfd[0].revents & (POLLIN | POLLERR | POLLHUP))
-	    ret |= IO_CanRead;
-	if (pfd[1].revents & (POLLIN | POLLERR | POLLHUP))
-	    ret |= IO_CanWrite;
-	if (pfd[0].revents & (POLLNVAL))
-	    ret |= IO_Closed;
-	if (pfd[1].revents & (POLLNVAL))
-	    ret |= IO_Closed;
+	ret |= pollResult(pfd[0].revents, wanted, IO_CanRead, IO_Output1);
+	ret |= pollResult(pfd[1].revents, wanted, IO_CanWrite, IO_Output2);
     }
 
 #elif defined(HAVE_WORKING_SELECT)
-    fd_set fds;
+    fd_set rfds;
+    fd_set wfds;
     int rc;
-
-    FD_ZERO(&fds);
-    FD_SET(fd1, &fds);
-    FD_SET(fd2, &fds);
-    rc = select(FD_SETSIZE, &fds, NULL, NULL, NULL);
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if (wanted & IO_CanRead)
+	FD_SET(fd1, &rfds);
+    if (wanted & IO_CanWrite)
+	FD_SET(fd2, &rfds);
+    if (wanted & IO_Output1)
+	FD_SET(fd1, &wfds);
+    if (wanted & IO_Output2)
+	FD_SET(fd2, &wfds);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    rc = select(FD_SETSIZE, &rfds, &wfds, NULL, (timeout >= 0) ? &tv : NULL);
     if (rc < 0) {
 	ret = -1;
 	if (errno == EBADF)
 	    ret = IO_Closed;
-    } else {
-	if (FD_ISSET(fd1, &fds))
+    } else if (rc > 0) {
+	if (FD_ISSET(fd1, &rfds))
 	    ret |= IO_CanRead;
-	if (FD_ISSET(fd2, &fds))
+	if (FD_ISSET(fd2, &rfds))
 	    ret |= IO_CanWrite;
+	if (FD_ISSET(fd1, &wfds))
+	    ret |= IO_Output1;
+	if (FD_ISSET(fd2, &wfds))
+	    ret |= IO_Output2;
     }
 #else
-    ret = (IO_CanRead | IO_CanWrite);
+    (void) timeout;
+    ret = wanted;
 #endif
 
     return ret;
@@ -638,6 +684,7 @@ ExitProgram(int code)
     luit_leaks();
     iso2022_leaks();
     charset_leaks();
+    other_leaks();
     fontenc_leaks();
 #ifdef USE_ICONV
     luitconv_leaks();
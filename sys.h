@@ -37,6 +37,8 @@ extern int ignore_unused;
 #define IO_CanRead   1
 #define IO_CanWrite  2
 #define IO_Closed    4
+#define IO_Output1   8
+#define IO_Output2   16
 
 #define TypeCalloc(type)    (type *) calloc((size_t) 1, sizeof(type))
 #define TypeCallocN(type,n) (type *) calloc((size_t) (n), sizeof(type))
@@ -44,7 +46,7 @@ extern int ignore_unused;
 #define SizeOf(v)        (sizeof(v) / sizeof(v[0]))
 
 int waitForOutput(int fd);
-int waitForInput(int fd1, int fd2);
+int waitForIO(int fd1, int fd2, int wanted, int timeout);
 int setWindowSize(int sfd, int dfd);
 int installHandler(int signum, void (*handler) (int));
 int copyTermios(int sfd, int dfd);
@@ -68,6 +70,7 @@ void luit_leaks(void);
 void charset_leaks(void);
 void fontenc_leaks(void);
 void iso2022_leaks(void);
+void other_leaks(void);
 void luitconv_leaks(void);
 void ExitProgram(int code) GCC_NORETURN;
 #else
@@ -25,8 +25,46 @@ THE SOFTWARE.
 #include <config.h>
 
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys.h>
 #include <trace.h>
 
+/*
+ * The binary trace is a ring of fixed-size records, overwriting the oldest
+ * when it wraps.  It is written to "Trace.bin" at exit, or on SIGUSR2, and
+ * can be read with tracedump.pl
+ */
+#define TRACE_RING 8192		/* must be a power of two */
+#define TRACE_FILE "Trace.bin"
+#define TRACE_MAGIC "luit-trace"
+
+typedef struct {
+    unsigned sec;
+    unsigned usec;
+    unsigned event;
+    unsigned args[3];
+} TraceRecord;
+
+static const char *const event_names[] =
+{
+    "none"
+    ,"copy-in"
+    ,"copy-out"
+    ,"flush"
+    ,"wait"
+    ,"sequence"
+    ,"recode"
+    ,"reverse"
+    ,"map-code"
+    ,"luit-reverse"
+    ,"decode"
+    ,"encode"
+};
+
+static TraceRecord trace_ring[TRACE_RING];
+static unsigned long trace_total;
+static pid_t trace_pid;
+
 void
 Trace(const char *fmt, ...)
 {
@@ -44,3 +82,53 @@ Trace(const char *fmt, ...)
     fflush(fp);
     va_end(ap);
 }
+
+void
+TraceEvent(TraceEventId event, unsigned arg1, unsigned arg2, unsigned arg3)
+{
+    TraceRecord *p = &trace_ring[trace_total++ & (TRACE_RING - 1)];
+    struct timeval now;
+
+    if (trace_pid == 0) {
+	trace_pid = getpid();
+	atexit(TraceFlush);
+    }
+    gettimeofday(&now, NULL);
+    p->sec = (unsigned) now.tv_sec;
+    p->usec = (unsigned) now.tv_usec;
+    p->event = (unsigned) event;
+    p->args[0] = arg1;
+    p->args[1] = arg2;
+    p->args[2] = arg3;
+}
+
+/*
+ * Write the ring, oldest record first, after a text header giving the record
+ * size and count, and the event names.
+ */
+void
+TraceFlush(void)
+{
+    FILE *fp;
+    unsigned long first;
+    unsigned long n;
+    size_t k;
+
+    if (trace_pid == 0 || trace_pid != getpid())
+	return;
+    if ((fp = fopen(TRACE_FILE, "wb")) == 0)
+	return;
+
+    first = (trace_total > TRACE_RING) ? (trace_total - TRACE_RING) : 0;
+    fprintf(fp, "%s %lu %lu %lu %lu\n",
+	    TRACE_MAGIC,
+	    (unsigned long) sizeof(TraceRecord),
+	    (unsigned long) SizeOf(event_names),
+	    trace_total - first,
+	    first);
+    for (k = 0; k < SizeOf(event_names); ++k)
+	fprintf(fp, "%s\n", event_names[k]);
+    for (n = first; n < trace_total; ++n)
+	fwrite(&trace_ring[n & (TRACE_RING - 1)], sizeof(TraceRecord), 1, fp);
+    fclose(fp);
+}
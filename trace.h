@@ -27,9 +27,33 @@ THE SOFTWARE.
 
 #include <luit.h>
 
+/*
+ * Events recorded in the binary trace ring, for the places which are called
+ * per-character or per-chunk, where formatted tracing is too slow.  Keep the
+ * names in trace.c in the same order.
+ */
+typedef enum {
+    evNONE = 0
+    ,evCOPY_IN			/* fd, count */
+    ,evCOPY_OUT			/* fd, count */
+    ,evFLUSH			/* fd, buffered, written */
+    ,evWAIT			/* fd, result, microseconds */
+    ,evSEQUENCE			/* first, second, length */
+    ,evRECODE			/* code, result, charset type */
+    ,evREVERSE			/* code, result, charset type */
+    ,evMAPCODE			/* code, result */
+    ,evLUIT_REVERSE		/* code, result */
+    ,evDECODE			/* bytes, characters */
+    ,evENCODE			/* characters, output encoding */
+    ,evLAST
+} TraceEventId;
+
 void Trace(const char *fmt, ...) GCC_PRINTFLIKE(1,2);
+void TraceEvent(TraceEventId, unsigned, unsigned, unsigned);
+void TraceFlush(void);
 
 #ifdef OPT_TRACE
+#define TRACE_EVENT(params) TraceEvent params
 #define TRACE(params) Trace params
 #if OPT_TRACE > 1
 #define TRACE2(params) Trace params
@@ -37,6 +61,7 @@ void Trace(const char *fmt, ...) GCC_PRINTFLIKE(1,2);
 #define TRACE2(params)		/* nothing */
 #endif
 #else
+#define TRACE_EVENT(params)	/* nothing */
 #define TRACE(params)		/* nothing */
 #define TRACE2(params)		/* nothing */
 #endif
@@ -0,0 +1,101 @@
+#!/usr/bin/perl -w
+# -----------------------------------------------------------------------------
+# Copyright 2026 by the luit contributors
+#
+# All Rights Reserved
+#
+# Permission to use, copy, modify, and distribute this software and its
+# documentation for any purpose and without fee is hereby granted,
+# provided that the above copyright notice appear in all copies and that
+# both that copyright notice and this permission notice appear in
+# supporting documentation, and that the name of the above listed
+# copyright holder(s) not be used in advertising or publicity pertaining
+# to distribution of the software without specific, written prior
+# permission.
+#
+# THE ABOVE LISTED COPYRIGHT HOLDER(S) DISCLAIM ALL WARRANTIES WITH REGARD
+# TO THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+# AND FITNESS, IN NO EVENT SHALL THE ABOVE LISTED COPYRIGHT HOLDER(S) BE
+# LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+# -----------------------------------------------------------------------------
+# Decode the binary trace written by luit when configured with --enable-trace.
+# The file starts with a text header giving the record size and count, and
+# the event names, followed by the records, oldest first.
+
+use strict;
+
+use Getopt::Std;
+
+our ( $opt_e, $opt_r );
+
+sub usage() {
+    print <<EOF;
+Usage: $0 [options] [Trace.bin]
+
+Options:
+  -e name  show only the given event (may be a comma-separated list)
+  -r       show times relative to the first record
+EOF
+    exit 1;
+}
+
+sub dump_trace($) {
+    my $name = $_[0];
+    my %wanted;
+    my $fh;
+
+    if ($opt_e) {
+        $wanted{$_} = 1 for ( split /,/, $opt_e );
+    }
+
+    open( $fh, "<", $name ) or die "cannot open $name: $!";
+    binmode $fh;
+
+    my $header = <$fh>;
+    die "$name: not a luit trace\n"
+      unless ( defined $header
+        and $header =~ /^luit-trace (\d+) (\d+) (\d+) (\d+)$/ );
+    my ( $size, $events, $count, $first ) = ( $1, $2, $3, $4 );
+    die "$name: unexpected record size $size\n" unless ( $size == 24 );
+
+    my @names;
+    for my $n ( 0 .. $events - 1 ) {
+        my $event = <$fh>;
+        chomp $event;
+        $names[$n] = $event;
+    }
+
+    printf "# %d records, %d lost\n", $count, $first;
+    my $start;
+    my $record;
+    my $index = $first;
+    while ( read( $fh, $record, $size ) == $size ) {
+        my ( $sec, $usec, $event, @args ) = unpack( "L6", $record );
+        my $when = $sec + $usec / 1e6;
+        $start = $when unless defined $start;
+        my $label =
+          ( $event < $events ) ? $names[$event] : sprintf( "event-%d", $event );
+        if ( not $opt_e or $wanted{$label} ) {
+            printf "%8d %17.6f %-14s %#x %#x %#x\n",
+              $index,
+              ( $opt_r ? ( $when - $start ) : $when ),
+              $label, @args;
+        }
+        ++$index;
+    }
+    close $fh;
+}
+
+&getopts('e:r') || &usage;
+
+if ( $#ARGV >= 0 ) {
+    &dump_trace($_) for (@ARGV);
+}
+else {
+    &dump_trace("Trace.bin");
+}
+
+1;